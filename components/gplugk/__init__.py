@@ -1,17 +1,144 @@
 import esphome.codegen as cg
-from esphome.components import uart
+from esphome.components import uart, web_server_base
+from esphome.components.web_server_base import CONF_WEB_SERVER_BASE_ID
 import esphome.config_validation as cv
-from esphome.const import CONF_ID, PLATFORM_ESP32
+import esphome.final_validate as fv
+from esphome.const import (
+    CONF_ID,
+    CONF_INTERVAL,
+    CONF_SENSORS,
+    PLATFORM_ESP32,
+    UNIT_AMPERE,
+    UNIT_KILOVOLT_AMPS,
+    UNIT_KILOWATT,
+    UNIT_KILOWATT_HOURS,
+    UNIT_PERCENT,
+    UNIT_VOLT,
+    UNIT_VOLT_AMPS,
+    UNIT_WATT,
+    UNIT_WATT_HOURS,
+)
 
 CODEOWNERS = ["@juerg-luthiger"]
 DEPENDENCIES = ["uart"]
 
 CONF_GPLUGK_ID = "gplugk_id"
 CONF_DECRYPTION_KEY = "decryption_key"
+CONF_RUNTIME_KEY = "runtime_key"
+CONF_STREAMING_DECRYPT = "streaming_decrypt"
+CONF_METER_PROFILE = "meter_profile"
+CONF_LOOP_BUDGET = "loop_budget"
+CONF_UART_EVENTS = "uart_events"
+CONF_HISTORY = "history"
+CONF_BUFFER_SIZE = "buffer_size"
+CONF_ENERGY_LOG = "energy_log"
+CONF_PARTITION = "partition"
+
+# Compiled-in keys; the component keeps one more slot for the runtime key
+MAX_DECRYPTION_KEYS = 3
+
+# Physical quantities, mirrors the Quantity enum in obis.h
+QUANTITY_ENERGY = "energy"
+QUANTITY_POWER = "power"
+QUANTITY_VOLTAGE = "voltage"
+QUANTITY_CURRENT = "current"
+QUANTITY_POWER_FACTOR = "power_factor"
+QUANTITY_IDENTIFIER = "identifier"
+# Only computed by the component, never sent by the meter
+QUANTITY_APPARENT_POWER = "apparent_power"
+QUANTITY_PERCENT = "percent"
+QUANTITY_RATIO = "ratio"
+
+# Numeric MeterData fields, as named in the sensor platform
+METER_SENSORS = {
+    # Energy totals
+    "active_energy_plus": QUANTITY_ENERGY,
+    "active_energy_minus": QUANTITY_ENERGY,
+    "reactive_energy_plus": QUANTITY_ENERGY,
+    "reactive_energy_minus": QUANTITY_ENERGY,
+    # Meter ID
+    "meter_id": QUANTITY_IDENTIFIER,
+    # Total power
+    "active_power_plus": QUANTITY_POWER,
+    "active_power_minus": QUANTITY_POWER,
+    "reactive_power_plus": QUANTITY_POWER,
+    "reactive_power_minus": QUANTITY_POWER,
+    # Voltage
+    "voltage_l1": QUANTITY_VOLTAGE,
+    "voltage_l2": QUANTITY_VOLTAGE,
+    "voltage_l3": QUANTITY_VOLTAGE,
+    # Current
+    "current_l1": QUANTITY_CURRENT,
+    "current_l2": QUANTITY_CURRENT,
+    "current_l3": QUANTITY_CURRENT,
+    # Active power per phase
+    "active_power_l1": QUANTITY_POWER,
+    "active_power_l2": QUANTITY_POWER,
+    "active_power_l3": QUANTITY_POWER,
+    "active_power_minus_l1": QUANTITY_POWER,
+    "active_power_minus_l2": QUANTITY_POWER,
+    "active_power_minus_l3": QUANTITY_POWER,
+    # Power factor
+    "power_factor": QUANTITY_POWER_FACTOR,
+    "power_factor_l1": QUANTITY_POWER_FACTOR,
+    "power_factor_l2": QUANTITY_POWER_FACTOR,
+    "power_factor_l3": QUANTITY_POWER_FACTOR,
+    # Active energy per phase
+    "active_energy_plus_l1": QUANTITY_ENERGY,
+    "active_energy_plus_l2": QUANTITY_ENERGY,
+    "active_energy_plus_l3": QUANTITY_ENERGY,
+    "active_energy_minus_l1": QUANTITY_ENERGY,
+    "active_energy_minus_l2": QUANTITY_ENERGY,
+    "active_energy_minus_l3": QUANTITY_ENERGY,
+}
+
+# Numeric MeterData fields computed from the ones above in the same decode pass.
+# They have no OBIS code and no raw value, so no scale and no history.
+DERIVED_SENSORS = {
+    "net_power": QUANTITY_POWER,
+    "apparent_power": QUANTITY_APPARENT_POWER,
+    "apparent_power_l1": QUANTITY_APPARENT_POWER,
+    "apparent_power_l2": QUANTITY_APPARENT_POWER,
+    "apparent_power_l3": QUANTITY_APPARENT_POWER,
+    "current_imbalance": QUANTITY_PERCENT,
+    "reactive_ratio": QUANTITY_RATIO,
+}
 
 gplugk_ns = cg.esphome_ns.namespace("gplugk")
 GplugkComponent = gplugk_ns.class_("GplugkComponent", cg.Component, uart.UARTDevice)
 
+MeterProfile = gplugk_ns.enum("MeterProfile")
+METER_PROFILES = {
+    "raw": MeterProfile.METER_PROFILE_RAW,
+    "kamstrup": MeterProfile.METER_PROFILE_KAMSTRUP,
+}
+
+# Default unit and accuracy per profile, mirrors OBIS_SCALERS in obis.h
+PROFILE_UNITS = {
+    "raw": {
+        QUANTITY_ENERGY: (UNIT_WATT_HOURS, 0),
+        QUANTITY_POWER: (UNIT_WATT, 0),
+        QUANTITY_VOLTAGE: (UNIT_VOLT, 0),
+        QUANTITY_CURRENT: (UNIT_AMPERE, 0),
+        QUANTITY_POWER_FACTOR: (None, 0),
+        QUANTITY_IDENTIFIER: (None, 0),
+        QUANTITY_APPARENT_POWER: (UNIT_VOLT_AMPS, 0),
+        QUANTITY_PERCENT: (UNIT_PERCENT, 1),
+        QUANTITY_RATIO: (None, 2),
+    },
+    "kamstrup": {
+        QUANTITY_ENERGY: (UNIT_KILOWATT_HOURS, 3),
+        QUANTITY_POWER: (UNIT_KILOWATT, 3),
+        QUANTITY_VOLTAGE: (UNIT_VOLT, 0),
+        QUANTITY_CURRENT: (UNIT_AMPERE, 2),
+        QUANTITY_POWER_FACTOR: (None, 2),
+        QUANTITY_IDENTIFIER: (None, 0),
+        QUANTITY_APPARENT_POWER: (UNIT_KILOVOLT_AMPS, 3),
+        QUANTITY_PERCENT: (UNIT_PERCENT, 1),
+        QUANTITY_RATIO: (None, 2),
+    },
+}
+
 
 def validate_key(value):
     value = cv.string_strict(value)
@@ -23,11 +150,74 @@ def validate_key(value):
         raise cv.Invalid("Decryption key must be hex values from 00 to FF") from exc
 
 
+HISTORY_SCHEMA = cv.Schema(
+    {
+        cv.GenerateID(CONF_WEB_SERVER_BASE_ID): cv.use_id(
+            web_server_base.WebServerBase
+        ),
+        cv.Required(CONF_SENSORS): cv.All(
+            cv.ensure_list(cv.one_of(*METER_SENSORS, lower=True)), cv.Length(min=1)
+        ),
+        cv.Optional(CONF_BUFFER_SIZE, default=16384): cv.int_range(
+            min=256, max=131072
+        ),
+    }
+)
+
+ENERGY_COUNTERS = [s for s, q in METER_SENSORS.items() if q == QUANTITY_ENERGY]
+
+ENERGY_LOG_SCHEMA = cv.Schema(
+    {
+        cv.GenerateID(CONF_WEB_SERVER_BASE_ID): cv.use_id(
+            web_server_base.WebServerBase
+        ),
+        # Label of a data partition in the partition table
+        cv.Optional(CONF_PARTITION, default="gplugk"): cv.All(
+            cv.string_strict, cv.Length(max=15)
+        ),
+        cv.Optional(CONF_INTERVAL, default="1h"): cv.All(
+            cv.positive_time_period_seconds,
+            cv.Range(min=cv.TimePeriod(minutes=1)),
+        ),
+        cv.Optional(
+            CONF_SENSORS,
+            default=[
+                "active_energy_plus",
+                "active_energy_minus",
+                "active_energy_plus_l1",
+                "active_energy_plus_l2",
+                "active_energy_plus_l3",
+                "active_energy_minus_l1",
+                "active_energy_minus_l2",
+                "active_energy_minus_l3",
+            ],
+        ): cv.All(
+            cv.ensure_list(cv.one_of(*ENERGY_COUNTERS, lower=True)),
+            cv.Length(min=1),
+        ),
+    }
+)
+
 CONFIG_SCHEMA = cv.All(
     cv.Schema(
         {
             cv.GenerateID(): cv.declare_id(GplugkComponent),
-            cv.Required(CONF_DECRYPTION_KEY): validate_key,
+            cv.Required(CONF_DECRYPTION_KEY): cv.All(
+                cv.ensure_list(validate_key),
+                cv.Length(min=1, max=MAX_DECRYPTION_KEYS),
+            ),
+            cv.Optional(CONF_RUNTIME_KEY, default=False): cv.boolean,
+            cv.Optional(CONF_STREAMING_DECRYPT, default=True): cv.boolean,
+            cv.Optional(CONF_METER_PROFILE, default="raw"): cv.enum(
+                METER_PROFILES, lower=True
+            ),
+            cv.Optional(
+                CONF_LOOP_BUDGET, default="5ms"
+            ): cv.positive_time_period_microseconds,
+            # Reads the UART from the driver's event queue, not available with Arduino
+            cv.Optional(CONF_UART_EVENTS): cv.All(cv.boolean, cv.only_with_esp_idf),
+            cv.Optional(CONF_HISTORY): HISTORY_SCHEMA,
+            cv.Optional(CONF_ENERGY_LOG): ENERGY_LOG_SCHEMA,
         }
     )
     .extend(uart.UART_DEVICE_SCHEMA)
@@ -35,8 +225,16 @@ CONFIG_SCHEMA = cv.All(
     cv.only_on([PLATFORM_ESP32]),
 )
 
-FINAL_VALIDATE_SCHEMA = uart.final_validate_device_schema(
-    "gplugk", baud_rate=2400, require_rx=True
+
+def _final_validate(config):
+    if config[CONF_RUNTIME_KEY] and "api" not in fv.full_config.get():
+        raise cv.Invalid(f"'{CONF_RUNTIME_KEY}' requires the 'api' component")
+    return config
+
+
+FINAL_VALIDATE_SCHEMA = cv.All(
+    uart.final_validate_device_schema("gplugk", baud_rate=2400, require_rx=True),
+    _final_validate,
 )
 
 
@@ -44,5 +242,38 @@ async def to_code(config):
     var = cg.new_Pvariable(config[CONF_ID])
     await cg.register_component(var, config)
     await uart.register_uart_device(var, config)
-    key = ", ".join(str(b) for b in config[CONF_DECRYPTION_KEY])
-    cg.add(var.set_decryption_key(cg.RawExpression(f"{{{key}}}")))
+    for key in config[CONF_DECRYPTION_KEY]:
+        key = ", ".join(str(b) for b in key)
+        cg.add(var.add_decryption_key(cg.RawExpression(f"{{{key}}}")))
+    if config[CONF_RUNTIME_KEY]:
+        cg.add_define("USE_GPLUGK_RUNTIME_KEY")
+        cg.add_define("USE_API_SERVICES")
+    cg.add(var.set_streaming(config[CONF_STREAMING_DECRYPT]))
+    cg.add(var.set_meter_profile(config[CONF_METER_PROFILE]))
+    cg.add(var.set_loop_budget(config[CONF_LOOP_BUDGET].total_microseconds))
+    if config.get(CONF_UART_EVENTS):
+        cg.add_define("USE_GPLUGK_UART_EVENTS")
+
+    if history := config.get(CONF_HISTORY):
+        server = await cg.get_variable(history[CONF_WEB_SERVER_BASE_ID])
+        cg.add(var.set_web_server_base(server))
+        cg.add(var.set_history_buffer_size(history[CONF_BUFFER_SIZE]))
+        channels = [f"F({s})" for s in dict.fromkeys(history[CONF_SENSORS])]
+        cg.add_define("USE_GPLUGK_HISTORY")
+        cg.add_define("USE_GPLUGK_WEB")
+        cg.add_define(
+            "GPLUGK_HISTORY_LIST(F, sep)", cg.RawExpression(" sep ".join(channels))
+        )
+
+    if energy_log := config.get(CONF_ENERGY_LOG):
+        server = await cg.get_variable(energy_log[CONF_WEB_SERVER_BASE_ID])
+        cg.add(var.set_web_server_base(server))
+        cg.add(var.set_energy_log_partition(energy_log[CONF_PARTITION]))
+        cg.add(var.set_energy_log_interval(energy_log[CONF_INTERVAL].total_seconds))
+        channels = [f"F({s})" for s in dict.fromkeys(energy_log[CONF_SENSORS])]
+        cg.add_define("USE_GPLUGK_ENERGY_LOG")
+        cg.add_define("USE_GPLUGK_WEB")
+        cg.add_define(
+            "GPLUGK_ENERGY_LOG_LIST(F, sep)",
+            cg.RawExpression(" sep ".join(channels)),
+        )
@@ -0,0 +1,36 @@
+import esphome.codegen as cg
+from esphome.components import binary_sensor
+import esphome.config_validation as cv
+from esphome.const import CONF_ID
+
+from .. import CONF_GPLUGK_ID, GplugkComponent
+
+AUTO_LOAD = ["gplugk"]
+
+CONFIG_SCHEMA = cv.Schema(
+    {
+        cv.GenerateID(CONF_GPLUGK_ID): cv.use_id(GplugkComponent),
+        # On while the meter reports more power fed in than drawn
+        cv.Optional("grid_export"): binary_sensor.binary_sensor_schema(),
+    }
+).extend(cv.COMPONENT_SCHEMA)
+
+
+async def to_code(config):
+    hub = await cg.get_variable(config[CONF_GPLUGK_ID])
+
+    binary_sensors = []
+    for key, conf in config.items():
+        if not isinstance(conf, dict):
+            continue
+        id = conf[CONF_ID]
+        if id and id.type == binary_sensor.BinarySensor:
+            sens = await binary_sensor.new_binary_sensor(conf)
+            cg.add(getattr(hub, f"set_{key}_binary_sensor")(sens))
+            binary_sensors.append(f"F({key})")
+
+    if binary_sensors:
+        cg.add_define(
+            "GPLUGK_BINARY_SENSOR_LIST(F, sep)",
+            cg.RawExpression(" sep ".join(binary_sensors)),
+        )
@@ -0,0 +1,146 @@
+#pragma once
+
+#include "esphome/components/uart/uart.h"
+#include "esphome/core/component.h"
+#include "esphome/core/hal.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#ifdef USE_GPLUGK_UART_EVENTS
+#include "esphome/components/uart/uart_component_esp_idf.h"
+#include <driver/uart.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/stream_buffer.h>
+#include <freertos/task.h>
+#endif
+
+#include "bytesource_base.h"
+#include "hdlc.h"
+
+namespace esphome::gplugk {
+
+// Polled from loop()
+class UARTPollSource : public ByteSource {
+ public:
+  UARTPollSource(uart::UARTDevice *uart, uint32_t timeout_ms) : uart_(uart), timeout_ms_(timeout_ms) {}
+
+  size_t available() override { return this->uart_->available(); }
+  bool read(uint8_t *data, size_t length) override {
+    if (!this->uart_->read_array(data, length))
+      return false;
+    this->last_read_ = millis();
+    return true;
+  }
+  bool quiet() override { return millis() - this->last_read_ > this->timeout_ms_; }
+
+ protected:
+  uart::UARTDevice *uart_;
+  uint32_t timeout_ms_;
+  uint32_t last_read_ = 0;
+};
+
+#ifdef USE_GPLUGK_UART_EVENTS
+// Read by a task that blocks on the UART driver's event queue. It runs when data
+// arrives, when the pattern detection sees an HDLC flag and once the line has been
+// quiet for the read timeout; then it wakes the component. Between frames nothing runs.
+class UARTEventSource : public ByteSource {
+ public:
+  static constexpr size_t BUFFER_SIZE = 2 * HDLC_MAX_FRAME_SIZE;
+  static constexpr uint32_t TASK_STACK_SIZE = 3072;
+  static constexpr UBaseType_t TASK_PRIORITY = 5;
+  static constexpr int PATTERN_QUEUE_SIZE = 16;
+
+  bool start(uart::IDFUARTComponent *uart, Component *owner, uint32_t timeout_ms) {
+    this->port_ = static_cast<uart_port_t>(uart->get_hw_serial_number());
+    this->queue_ = uart->get_uart_event_queue();
+    this->owner_ = owner;
+    this->timeout_ticks_ = pdMS_TO_TICKS(timeout_ms);
+    if (this->queue_ == nullptr || *this->queue_ == nullptr)
+      return false;
+    this->buffer_ = xStreamBufferCreate(BUFFER_SIZE, 1);
+    if (this->buffer_ == nullptr)
+      return false;
+    // DLMS does not stuff flag bytes, so a flag inside the payload is only an extra wakeup
+    if (uart_enable_pattern_det_baud_intr(this->port_, HDLC_FLAG, 1, 9, 0, 0) != ESP_OK ||
+        uart_pattern_queue_reset(this->port_, PATTERN_QUEUE_SIZE) != ESP_OK)
+      return false;
+    return xTaskCreate(&UARTEventSource::task_, "gplugk_rx", TASK_STACK_SIZE, this, TASK_PRIORITY, nullptr) == pdPASS;
+  }
+
+  size_t available() override { return xStreamBufferBytesAvailable(this->buffer_); }
+  bool read(uint8_t *data, size_t length) override {
+    return xStreamBufferReceive(this->buffer_, data, length, 0) == length;
+  }
+  bool quiet() override { return this->quiet_; }
+  bool wakes_loop() const override { return true; }
+
+  // Times bytes were lost because the driver or the stream buffer ran full
+  uint32_t overflows() const { return this->overflows_; }
+
+ protected:
+  static void task_(void *arg) {
+    auto *self = static_cast<UARTEventSource *>(arg);
+    uart_event_t event;
+    bool receiving = false;
+    for (;;) {
+      if (xQueueReceive(*self->queue_, &event, receiving ? self->timeout_ticks_ : portMAX_DELAY) != pdTRUE) {
+        receiving = false;
+        self->quiet_ = true;
+        self->owner_->enable_loop_soon_any_context();
+        continue;
+      }
+      switch (event.type) {
+        case UART_PATTERN_DET:
+          // Positions are not needed, the flags are found again when the frame is parsed
+          while (uart_pattern_pop_pos(self->port_) >= 0)
+            ;
+          // fall through
+        case UART_DATA:
+          // Cleared before the bytes are visible, so the component never sees new bytes as quiet
+          self->quiet_ = false;
+          receiving = true;
+          self->drain_();
+          self->owner_->enable_loop_soon_any_context();
+          break;
+        case UART_FIFO_OVF:
+        case UART_BUFFER_FULL:
+          uart_flush_input(self->port_);
+          xQueueReset(*self->queue_);
+          self->overflows_++;
+          break;
+        default:
+          break;
+      }
+    }
+  }
+
+  // Moves everything the driver has buffered into the stream buffer
+  void drain_() {
+    size_t buffered = 0;
+    uart_get_buffered_data_len(this->port_, &buffered);
+    uint8_t chunk[64];
+    while (buffered > 0) {
+      int count = uart_read_bytes(this->port_, chunk, std::min(buffered, sizeof(chunk)), 0);
+      if (count <= 0)
+        break;
+      if (xStreamBufferSend(this->buffer_, chunk, count, 0) != static_cast<size_t>(count))
+        this->overflows_++;
+      buffered -= count;
+    }
+  }
+
+  uart_port_t port_{};
+  QueueHandle_t *queue_{nullptr};
+  Component *owner_{nullptr};
+  TickType_t timeout_ticks_ = 0;
+  StreamBufferHandle_t buffer_{nullptr};
+  std::atomic<bool> quiet_{false};
+  std::atomic<uint32_t> overflows_{0};
+};
+#endif
+
+}  // namespace esphome::gplugk
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace esphome::gplugk {
+
+// Where received bytes come from. The component only reads through this interface, so a
+// simulated meter can stand in for the UART, e.g. in host tests. The UART sources are in
+// bytesource.h.
+class ByteSource {
+ public:
+  virtual ~ByteSource() = default;
+  virtual size_t available() = 0;
+  // Reads exactly length bytes; false if fewer are available
+  virtual bool read(uint8_t *data, size_t length) = 0;
+  // True once no byte arrived for the read timeout, i.e. the frame on the line has ended
+  virtual bool quiet() = 0;
+  // True if the source wakes the component by itself, so loop() can be disabled while idle
+  virtual bool wakes_loop() const { return false; }
+};
+
+// Appends what the source has available to buffer, at most limit bytes; returns the
+// number of bytes appended
+inline size_t read_available(ByteSource &source, std::vector<uint8_t> &buffer, size_t limit) {
+  size_t count = std::min(source.available(), limit);
+  size_t done = 0;
+  uint8_t chunk[64];
+  while (done < count) {
+    size_t length = std::min(count - done, sizeof(chunk));
+    if (!source.read(chunk, length))
+      break;
+    buffer.insert(buffer.end(), chunk, chunk + length);
+    done += length;
+  }
+  return done;
+}
+
+}  // namespace esphome::gplugk
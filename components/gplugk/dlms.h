@@ -32,5 +32,36 @@ static constexpr uint8_t DATA_NOTIFICATION_HEADER[] = {
     0xFF, 0x80, 0x00, 0x00,                               // deviation=-128 (not specified)
 };
 static constexpr uint8_t DATA_NOTIFICATION_HEADER_SIZE = sizeof(DATA_NOTIFICATION_HEADER);
+static constexpr uint8_t DATA_NOTIFICATION_DATETIME_OFFSET = 5;
+
+// Known plaintext in the first 16-byte block of a push: the data-notification tag and
+// the date-time length. A wrong key matches by chance with probability 2^-16.
+inline bool data_notification_start_valid(const uint8_t *plaintext) {
+  return plaintext[0] == DATA_NOTIFICATION_TAG &&
+         plaintext[DATA_NOTIFICATION_DATETIME_OFFSET] == DATA_NOTIFICATION_HEADER[DATA_NOTIFICATION_DATETIME_OFFSET];
+}
+
+// Bytes needed before the ciphering header can be parsed (extended length form)
+static constexpr uint8_t DLMS_MAX_HEADER_SIZE = DLMS_PAYLOAD_OFFSET + DLMS_HEADER_EXT_OFFSET;
+
+// Parses a general-glo-ciphering header without logging. Fails on anything the
+// decoder does not support; message_length excludes the security header.
+inline bool dlms_parse_header(const uint8_t *apdu, uint16_t &message_length, uint16_t &header_offset) {
+  if (apdu[DLMS_CIPHER_OFFSET] != GLO_CIPHERING || apdu[DLMS_SYST_OFFSET] != 0x08)
+    return false;
+
+  message_length = apdu[DLMS_LENGTH_OFFSET];
+  header_offset = 0;
+  if (message_length == TWO_BYTE_LENGTH) {
+    message_length = (apdu[DLMS_LENGTH_OFFSET + 1] << 8) | apdu[DLMS_LENGTH_OFFSET + 2];
+    header_offset = DLMS_HEADER_EXT_OFFSET;
+  }
+  if (message_length < DLMS_LENGTH_CORRECTION)
+    return false;
+  message_length -= DLMS_LENGTH_CORRECTION;
+
+  uint8_t sec_byte = apdu[header_offset + DLMS_SECBYTE_OFFSET];
+  return sec_byte == KAMSTRUP_SECURITY_BYTE || sec_byte == 0x21 || sec_byte == 0x20;
+}
 
 }  // namespace esphome::gplugk
@@ -0,0 +1,383 @@
+#pragma once
+
+#include "timeseries.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+#ifdef USE_ESP32
+#include <esp_partition.h>
+#endif
+
+namespace esphome::gplugk {
+
+// Storage with NOR flash rules: erased bytes read 0xFF, a write can only clear bits,
+// and only whole sectors can be erased.
+class LogStorage {
+ public:
+  static constexpr size_t SECTOR_SIZE = 4096;
+  static constexpr size_t PAGE_SIZE = 256;
+
+  virtual ~LogStorage() = default;
+  virtual size_t size() const = 0;
+  virtual bool read(size_t offset, uint8_t *data, size_t length) = 0;
+  virtual bool write(size_t offset, const uint8_t *data, size_t length) = 0;
+  virtual bool erase_sector(size_t offset) = 0;
+};
+
+#ifdef USE_ESP32
+// Raw data partition, found by its label in the partition table
+class PartitionStorage : public LogStorage {
+ public:
+  bool open(const char *label) {
+    this->partition_ = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    return this->partition_ != nullptr;
+  }
+
+  size_t size() const override { return this->partition_->size; }
+  bool read(size_t offset, uint8_t *data, size_t length) override {
+    return esp_partition_read(this->partition_, offset, data, length) == ESP_OK;
+  }
+  bool write(size_t offset, const uint8_t *data, size_t length) override {
+    return esp_partition_write(this->partition_, offset, data, length) == ESP_OK;
+  }
+  bool erase_sector(size_t offset) override {
+    return esp_partition_erase_range(this->partition_, offset, SECTOR_SIZE) == ESP_OK;
+  }
+
+ protected:
+  const esp_partition_t *partition_{nullptr};
+};
+#else
+// Host stand-in: a file of the given size that behaves like erased flash
+class FileStorage : public LogStorage {
+ public:
+  ~FileStorage() override {
+    if (this->file_ != nullptr)
+      fclose(this->file_);
+  }
+
+  bool open(const char *path, size_t size) {
+    this->size_ = size;
+    this->file_ = fopen(path, "r+b");
+    if (this->file_ != nullptr)
+      return true;
+    this->file_ = fopen(path, "w+b");
+    if (this->file_ == nullptr)
+      return false;
+    std::vector<uint8_t> erased(size, 0xFF);
+    return fwrite(erased.data(), 1, size, this->file_) == size && fflush(this->file_) == 0;
+  }
+
+  size_t size() const override { return this->size_; }
+  bool read(size_t offset, uint8_t *data, size_t length) override {
+    return fseek(this->file_, offset, SEEK_SET) == 0 && fread(data, 1, length, this->file_) == length;
+  }
+  bool write(size_t offset, const uint8_t *data, size_t length) override {
+    std::vector<uint8_t> programmed(length);
+    if (!this->read(offset, programmed.data(), length))
+      return false;
+    for (size_t i = 0; i < length; i++)
+      programmed[i] &= data[i];
+    return this->put_(offset, programmed.data(), length);
+  }
+  bool erase_sector(size_t offset) override {
+    std::vector<uint8_t> erased(SECTOR_SIZE, 0xFF);
+    return this->put_(offset, erased.data(), SECTOR_SIZE);
+  }
+
+ protected:
+  bool put_(size_t offset, const uint8_t *data, size_t length) {
+    return fseek(this->file_, offset, SEEK_SET) == 0 && fwrite(data, 1, length, this->file_) == length &&
+           fflush(this->file_) == 0;
+  }
+
+  FILE *file_{nullptr};
+  size_t size_{0};
+};
+#endif
+
+// Append-only log of counter snapshots, written round-robin across the sectors of a
+// LogStorage.
+//
+// Every sector starts with a header; the one with the highest sequence is being
+// written. Its first record holds absolute values, each later record the change since
+// the one before:
+//   length, varint(zigzag(dt - interval)), varint(zigzag(dvalue)) per channel
+// Erased flash ends the records of a sector. append() keeps records in RAM until
+// flush() writes them; each byte is programmed once and a sector is only erased when
+// the log wraps around to it.
+class EnergyLog {
+ public:
+  static constexpr uint8_t MAX_CHANNELS = 16;
+  static constexpr uint32_t MAGIC = 0x4C4B5047;  // "GPKL"
+  static constexpr size_t MAX_RECORD_SIZE = 1 + VARINT_MAX_SIZE * (MAX_CHANNELS + 1);
+
+  struct SectorHeader {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t layout;    // identifies the channel list
+    uint32_t interval;  // seconds, the expected dt of a record
+  };
+
+  // Finds the newest sector and the last record in it. Sectors written with another
+  // layout are ignored and reused once the log reaches them.
+  bool open(LogStorage *storage, uint8_t channels, uint32_t layout, uint32_t interval) {
+    this->storage_ = storage;
+    this->channels_ = std::min(channels, MAX_CHANNELS);
+    this->layout_ = layout;
+    this->interval_ = interval;
+    this->sectors_ = storage->size() / LogStorage::SECTOR_SIZE;
+    if (this->sectors_ < 2)
+      return false;
+
+    bool found = false;
+    SectorHeader header;
+    for (size_t sector = 0; sector < this->sectors_; sector++) {
+      if (this->read_header_(sector, header) && (!found || header.sequence > this->sequence_)) {
+        found = true;
+        this->head_ = sector;
+        this->sequence_ = header.sequence;
+      }
+    }
+    if (!found)
+      return this->start_sector_(0, 1);
+
+    std::vector<uint8_t> buffer(LogStorage::SECTOR_SIZE);
+    if (!storage->read(this->head_ * LogStorage::SECTOR_SIZE, buffer.data(), buffer.size()))
+      return false;
+    this->read_header_(this->head_, header);
+    size_t end = scan_sector_(buffer.data(), header.interval, this->channels_,
+                              [this](uint32_t time, const int64_t *values) {
+                                this->last_time_ = time;
+                                std::copy(values, values + this->channels_, this->last_values_);
+                                this->empty_ = false;
+                                return true;
+                              });
+    this->absolute_ = end == sizeof(SectorHeader);
+    this->write_offset_ = this->head_ * LogStorage::SECTOR_SIZE + end;
+    if (this->empty_) {
+      // Wrapped just before a reset: the last record is in an older sector
+      this->for_each([this](uint32_t time, const int64_t *) {
+        this->last_time_ = time;
+        this->empty_ = false;
+        return true;
+      });
+    }
+    // A reset during a flush can leave part of a record after the last complete one.
+    // Appending there would program those bytes twice, so continue in the next sector.
+    bool erased = std::all_of(buffer.begin() + end, buffer.end(), [](uint8_t byte) { return byte == 0xFF; });
+    // A record written with another interval cannot be continued with this one
+    if (!erased || header.interval != interval)
+      return this->start_sector_((this->head_ + 1) % this->sectors_, this->sequence_ + 1);
+    return true;
+  }
+
+  void append(uint32_t time, const int64_t *values) {
+    uint8_t record[MAX_RECORD_SIZE];
+    size_t length = this->encode_(time, values, record);
+    // From head_, not write_offset_: a full sector leaves write_offset_ on the next one
+    size_t sector_end = (this->head_ + 1) * LogStorage::SECTOR_SIZE;
+    if (this->write_offset_ + this->pending_.size() + length > sector_end) {
+      // Wrap into the oldest sector, which starts again with absolute values
+      this->flush(true);
+      this->start_sector_((this->head_ + 1) % this->sectors_, this->sequence_ + 1);
+      length = this->encode_(time, values, record);
+    }
+    this->pending_.insert(this->pending_.end(), record, record + length);
+    this->absolute_ = false;
+    this->empty_ = false;
+    this->last_time_ = time;
+    std::copy(values, values + this->channels_, this->last_values_);
+    this->flush(false);
+  }
+
+  // Writes the pending records up to the last complete page, or all of them
+  bool flush(bool partial) {
+    size_t end = this->write_offset_ + this->pending_.size();
+    size_t length = this->pending_.size();
+    if (!partial) {
+      size_t aligned = end - end % LogStorage::PAGE_SIZE;
+      length = aligned > this->write_offset_ ? aligned - this->write_offset_ : 0;
+    }
+    if (length == 0)
+      return true;
+    // Never program the same bytes twice, even if the write failed
+    bool ok = this->storage_->write(this->write_offset_, this->pending_.data(), length);
+    this->pending_.erase(this->pending_.begin(), this->pending_.begin() + length);
+    this->write_offset_ += length;
+    return ok;
+  }
+
+  // Erasing a sector takes tens of milliseconds. Once the head sector may not fit
+  // another record, erase_next() prepares the one append() wraps into, so the caller
+  // can do it in a step of its own; otherwise append() erases it when it wraps.
+  bool needs_erase() const {
+    size_t sector_end = (this->head_ + 1) * LogStorage::SECTOR_SIZE;
+    return !this->next_erased_ && this->write_offset_ + this->pending_.size() + MAX_RECORD_SIZE > sector_end;
+  }
+  bool erase_next() {
+    size_t next = (this->head_ + 1) % this->sectors_;
+    this->next_erased_ = this->storage_->erase_sector(next * LogStorage::SECTOR_SIZE);
+    return this->next_erased_;
+  }
+
+  // The part of the state that changes while the log is written. A reader in another
+  // task takes it under the writer's lock and reads the log without holding it.
+  struct View {
+    size_t head;
+    uint32_t sequence;
+    size_t write_offset;
+    std::vector<uint8_t> pending;
+  };
+  View view() const { return {this->head_, this->sequence_, this->write_offset_, this->pending_}; }
+
+  // Calls callback(time, values) for every record with time >= from, oldest first,
+  // including pending ones, until it returns false. Records before from may be passed
+  // too: only sectors that end before from are skipped.
+  template<typename F> void for_each(F &&callback, uint32_t from = 0) const {
+    this->for_each(this->view(), callback, from);
+  }
+  template<typename F> void for_each(const View &view, F &&callback, uint32_t from = 0) const {
+    std::vector<std::pair<uint32_t, size_t>> order;
+    SectorHeader header;
+    for (size_t sector = 0; sector < this->sectors_; sector++) {
+      if (this->read_header_(sector, header))
+        order.emplace_back(header.sequence, sector);
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<uint8_t> buffer(LogStorage::SECTOR_SIZE);
+    bool stopped = false;
+    for (size_t i = 0; i < order.size() && !stopped; i++) {
+      // All records of a sector are older than the first one of the next sector
+      uint32_t next_time;
+      if (i + 1 < order.size() && this->first_time_(order[i + 1].second, next_time) && next_time <= from)
+        continue;
+      size_t offset = order[i].second * LogStorage::SECTOR_SIZE;
+      if (!this->storage_->read(offset, buffer.data(), buffer.size()))
+        continue;
+      // Reused by the writer since the order was taken
+      std::copy_n(buffer.begin(), sizeof(header), reinterpret_cast<uint8_t *>(&header));
+      if (header.magic != MAGIC || header.layout != this->layout_ || header.sequence != order[i].first)
+        continue;
+      // The pending records belong to the head sector as it was when the view was taken
+      if (order[i].second == view.head && order[i].first == view.sequence &&
+          view.write_offset - offset + view.pending.size() <= buffer.size())
+        std::copy(view.pending.begin(), view.pending.end(), buffer.begin() + (view.write_offset - offset));
+      scan_sector_(buffer.data(), header.interval, this->channels_, [&](uint32_t time, const int64_t *values) {
+        stopped = !callback(time, values);
+        return !stopped;
+      });
+    }
+  }
+
+  // No record to continue from, e.g. on first boot
+  bool empty() const { return this->empty_; }
+  uint32_t last_time() const { return this->last_time_; }
+  size_t sectors() const { return this->sectors_; }
+  size_t pending() const { return this->pending_.size(); }
+
+ protected:
+  bool read_header_(size_t sector, SectorHeader &header) const {
+    return this->storage_->read(sector * LogStorage::SECTOR_SIZE, reinterpret_cast<uint8_t *>(&header),
+                                sizeof(header)) &&
+           header.magic == MAGIC && header.layout == this->layout_;
+  }
+
+  // Time of the first record of a sector, which holds it as an absolute value
+  bool first_time_(size_t sector, uint32_t &time) const {
+    uint8_t data[sizeof(SectorHeader) + 1 + VARINT_MAX_SIZE];
+    if (!this->storage_->read(sector * LogStorage::SECTOR_SIZE, data, sizeof(data)))
+      return false;
+    const uint8_t *pos = data + sizeof(SectorHeader) + 1;
+    uint64_t value;
+    uint8_t length = data[sizeof(SectorHeader)];
+    if (length == 0 || length == 0xFF || !varint_decode(pos, data + sizeof(data), value))
+      return false;
+    time = value;
+    return true;
+  }
+
+  bool start_sector_(size_t sector, uint32_t sequence) {
+    this->head_ = sector;
+    this->sequence_ = sequence;
+    this->absolute_ = true;
+    size_t offset = sector * LogStorage::SECTOR_SIZE;
+    this->write_offset_ = offset + sizeof(SectorHeader);
+    SectorHeader header{MAGIC, sequence, this->layout_, this->interval_};
+    bool erased = std::exchange(this->next_erased_, false) || this->storage_->erase_sector(offset);
+    return erased && this->storage_->write(offset, reinterpret_cast<const uint8_t *>(&header), sizeof(header));
+  }
+
+  size_t encode_(uint32_t time, const int64_t *values, uint8_t *record) const {
+    uint8_t *pos = record + 1;
+    if (this->absolute_) {
+      pos += varint_encode(time, pos);
+      for (uint8_t i = 0; i < this->channels_; i++)
+        pos += varint_encode(zigzag_encode(values[i]), pos);
+    } else {
+      int64_t dt = static_cast<int64_t>(time) - this->last_time_;
+      pos += varint_encode(zigzag_encode(dt - this->interval_), pos);
+      for (uint8_t i = 0; i < this->channels_; i++)
+        pos += varint_encode(zigzag_encode(values[i] - this->last_values_[i]), pos);
+    }
+    record[0] = pos - record - 1;
+    return pos - record;
+  }
+
+  // Decodes the records of one sector until callback returns false; returns the offset
+  // after the last one
+  template<typename F>
+  static size_t scan_sector_(const uint8_t *sector, uint32_t interval, uint8_t channels, F &&callback) {
+    size_t pos = sizeof(SectorHeader);
+    uint32_t time = 0;
+    int64_t values[MAX_CHANNELS]{};
+    bool absolute = true;
+    while (pos < LogStorage::SECTOR_SIZE) {
+      uint8_t length = sector[pos];
+      if (length == 0 || length == 0xFF || pos + 1 + length > LogStorage::SECTOR_SIZE)
+        break;
+      const uint8_t *p = &sector[pos + 1];
+      const uint8_t *end = p + length;
+      uint64_t value;
+      if (!varint_decode(p, end, value))
+        break;
+      time = absolute ? value : time + interval + zigzag_decode(value);
+      bool valid = true;
+      for (uint8_t i = 0; i < channels && valid; i++) {
+        valid = varint_decode(p, end, value);
+        // Wraps rather than overflows on a damaged record, which is rejected below
+        uint64_t base = absolute ? 0 : static_cast<uint64_t>(values[i]);
+        values[i] = static_cast<int64_t>(base + static_cast<uint64_t>(zigzag_decode(value)));
+      }
+      if (!valid || p != end)
+        break;
+      absolute = false;
+      pos += 1 + length;
+      if (!callback(time, static_cast<const int64_t *>(values)))
+        break;
+    }
+    return pos;
+  }
+
+  LogStorage *storage_{nullptr};
+  uint8_t channels_ = 0;
+  uint32_t layout_ = 0;
+  uint32_t interval_ = 0;
+  size_t sectors_ = 0;
+  size_t head_ = 0;
+  uint32_t sequence_ = 0;
+  size_t write_offset_ = 0;  // first byte of the log not yet written
+  bool absolute_ = true;     // next record starts a sector
+  bool empty_ = true;
+  bool next_erased_ = false;  // by erase_next(), for the next start_sector_()
+  std::vector<uint8_t> pending_;
+  uint32_t last_time_ = 0;
+  int64_t last_values_[MAX_CHANNELS]{};
+};
+
+}  // namespace esphome::gplugk
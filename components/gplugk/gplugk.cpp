@@ -1,29 +1,164 @@
 #include "gplugk.h"
 
-#include "mbedtls/esp_config.h"
-#include "mbedtls/gcm.h"
+#include <cmath>
 
 namespace esphome::gplugk
 {
 
   static constexpr const char *TAG = "gplugk";
 
+  // Bytes needed before the HDLC, LLC and ciphering headers of a frame can be parsed
+  static constexpr uint16_t STREAM_HEADER_SIZE = HDLC_INFO_OFFSET + LLC_HEADER_SIZE + DLMS_MAX_HEADER_SIZE;
+  static constexpr uint16_t GCM_BLOCK_SIZE = 16;
+#if defined(USE_GPLUGK_ENERGY_LOG) && !defined(USE_ESP32)
+  static constexpr size_t HOST_ENERGY_LOG_SIZE = 64 * 1024;
+#endif
+
+  void GplugkComponent::setup()
+  {
+    // Expand every AES key schedule once instead of per frame
+    for (auto &entry : this->keyring_)
+      mbedtls_gcm_init(&entry.ctx);
+    for (uint8_t key = 0; key < this->key_count_; key++)
+      this->expand_key_(key);
+    this->plaintext_.resize(MAX_MESSAGE_LENGTH);
+
+#ifdef USE_GPLUGK_RUNTIME_KEY
+    // A key set at runtime is the newest one, so start with it
+    this->runtime_key_pref_ = global_preferences->make_preference<RuntimeKey>(fnv1_hash("gplugk_runtime_key"), true);
+    RuntimeKey stored{};
+    if (this->runtime_key_pref_.load(&stored) && stored.set)
+    {
+      std::copy(std::begin(stored.key), std::end(stored.key), this->keyring_[this->key_count_].key.begin());
+      if (this->expand_key_(this->key_count_))
+        this->active_key_ = this->key_count_++;
+    }
+    this->register_service(&GplugkComponent::on_set_decryption_key_, "gplugk_set_decryption_key", {"key"});
+#endif
+
+    // One multiplier per field, so decoding is a single integer-to-float conversion
+    for (uint8_t field = 0; field < MeterField::OBIS_COUNT; field++)
+    {
+      const ObisScaler &scaler = OBIS_SCALERS[this->meter_profile_][FIELD_QUANTITIES[field]];
+      this->scales_[field] =
+          this->scale_overrides_[field] != 0.0f ? this->scale_overrides_[field] : powf(10.0f, scaler.exponent);
+    }
+    this->power_scale_ = powf(10.0f, OBIS_SCALERS[this->meter_profile_][POWER].exponent);
+    this->apparent_power_scale_ = powf(10.0f, OBIS_SI_EXPONENTS[VOLTAGE] + OBIS_SI_EXPONENTS[CURRENT] +
+                                                   OBIS_SCALERS[this->meter_profile_][POWER].exponent);
+
+#ifdef USE_GPLUGK_ENERGY_LOG
+#ifdef USE_ESP32
+    bool storage = this->energy_storage_.open(this->energy_log_partition_);
+#else
+    std::string path = std::string(this->energy_log_partition_) + ".bin";
+    bool storage = this->energy_storage_.open(path.c_str(), HOST_ENERGY_LOG_SIZE);
+#endif
+    if (!storage)
+    {
+      ESP_LOGE(TAG, "Energy log: partition '%s' not found", this->energy_log_partition_);
+    }
+    else if (!this->energy_log_.open(&this->energy_storage_, ENERGY_LOG_CHANNEL_COUNT, fnv1_hash(ENERGY_LOG_LAYOUT),
+                                     this->energy_log_interval_))
+    {
+      ESP_LOGE(TAG, "Energy log: partition '%s' too small or not writable", this->energy_log_partition_);
+    }
+    else
+    {
+      this->energy_log_ready_ = true;
+      if (!this->energy_log_.empty())
+        this->energy_last_slot_ = this->energy_log_.last_time() / this->energy_log_interval_;
+    }
+#endif
+
+#ifdef USE_GPLUGK_WEB
+    this->web_server_base_->init();
+#endif
+#ifdef USE_GPLUGK_HISTORY
+    // Split the history budget evenly; each ring allocates once and never grows
+    for (auto &ring : this->history_)
+      ring.init(this->history_buffer_size_ / HISTORY_CHANNEL_COUNT);
+    this->web_server_base_->add_handler(
+        new RequestHandler(this, HISTORY_URL, &GplugkComponent::handle_history_request)); // NOLINT
+#endif
+#ifdef USE_GPLUGK_ENERGY_LOG
+    this->web_server_base_->add_handler(
+        new RequestHandler(this, ENERGY_LOG_URL, &GplugkComponent::handle_energy_request)); // NOLINT
+#endif
+
+#ifdef USE_GPLUGK_UART_EVENTS
+    // Only in place of the polled UART, not of a source set with set_byte_source()
+    if (this->source_ == &this->poll_source_)
+    {
+      auto *uart = static_cast<uart::IDFUARTComponent *>(this->parent_);
+      if (this->event_source_.start(uart, this, this->read_timeout_))
+        this->source_ = &this->event_source_;
+      else
+        ESP_LOGW(TAG, "UART events unavailable, polling the UART instead");
+    }
+#endif
+  }
+
   void GplugkComponent::dump_config()
   {
     ESP_LOGCONFIG(TAG,
                   "Gplugk (Kamstrup):\n"
-                  "  Read Timeout: %u ms",
-                  this->read_timeout_);
+                  "  Read Timeout: %u ms\n"
+                  "  Streaming Decryption: %s\n"
+                  "  Meter Profile: %s\n"
+                  "  Decryption Keys: %u (active %u)\n"
+                  "  Loop Budget: %u us\n"
+                  "  UART Events: %s",
+                  this->read_timeout_, YESNO(this->streaming_),
+                  this->meter_profile_ == METER_PROFILE_KAMSTRUP ? "kamstrup" : "raw", this->key_count_,
+                  this->active_key_ + 1, this->loop_budget_us_, YESNO(this->source_->wakes_loop()));
+#ifdef USE_GPLUGK_HISTORY
+    ESP_LOGCONFIG(TAG, "  History: %u bytes, %u channels at %s", (unsigned)this->history_buffer_size_,
+                  (unsigned)HISTORY_CHANNEL_COUNT, HISTORY_URL);
+#endif
+#ifdef USE_GPLUGK_ENERGY_LOG
+    ESP_LOGCONFIG(TAG, "  Energy Log: partition '%s' (%u sectors), every %u s, %u channels at %s",
+                  this->energy_log_partition_, (unsigned)this->energy_log_.sectors(), this->energy_log_interval_,
+                  (unsigned)ENERGY_LOG_CHANNEL_COUNT, ENERGY_LOG_URL);
+#endif
 #define GPLUGK_LOG_SENSOR(s) LOG_SENSOR("  ", #s, this->s##_sensor_);
     GPLUGK_SENSOR_LIST(GPLUGK_LOG_SENSOR, )
+    GPLUGK_DIAGNOSTIC_SENSOR_LIST(GPLUGK_LOG_SENSOR, )
 #define GPLUGK_LOG_TEXT_SENSOR(s) LOG_TEXT_SENSOR("  ", #s, this->s##_text_sensor_);
     GPLUGK_TEXT_SENSOR_LIST(GPLUGK_LOG_TEXT_SENSOR, )
+#define GPLUGK_LOG_BINARY_SENSOR(s) LOG_BINARY_SENSOR("  ", #s, this->s##_binary_sensor_);
+    GPLUGK_BINARY_SENSOR_LIST(GPLUGK_LOG_BINARY_SENSOR, )
   }
 
   void GplugkComponent::loop()
   {
-    size_t avail = this->available();
-    if (avail > 0)
+    uint32_t start = micros();
+    if (this->job_.stage == FrameJob::IDLE)
+    {
+      if (!this->receive_())
+      {
+        // Nothing to do until the source reports new bytes or a quiet line
+        if (this->source_->wakes_loop())
+          this->disable_loop();
+        return;
+      }
+      this->job_ = FrameJob{};
+      this->job_.stage = FrameJob::VALIDATE;
+    }
+    this->run_stages_(start);
+  }
+
+  bool GplugkComponent::receive_()
+  {
+#ifdef USE_GPLUGK_UART_EVENTS
+    uint32_t overflows = this->event_source_.overflows();
+    if (overflows != this->reported_overflows_)
+    {
+      ESP_LOGW(TAG, "UART receive overflow, bytes were lost");
+      this->reported_overflows_ = overflows;
+    }
+#endif
+    if (this->source_->available() > 0)
     {
       size_t remaining = HDLC_MAX_FRAME_SIZE - this->receive_buffer_.size();
       if (remaining == 0)
@@ -32,52 +167,255 @@ namespace esphome::gplugk
       }
       else
       {
-        if (avail > remaining)
-        {
-          avail = remaining;
-        }
-        uint8_t buf[64];
-        while (avail > 0)
-        {
-          size_t to_read = std::min(avail, sizeof(buf));
-          if (!this->read_array(buf, to_read))
-          {
-            break;
-          }
-          avail -= to_read;
-          this->receive_buffer_.insert(this->receive_buffer_.end(), buf, buf + to_read);
-          this->last_read_ = millis();
-        }
+        read_available(*this->source_, this->receive_buffer_, remaining);
       }
     }
 
-    if (!this->receive_buffer_.empty() && millis() - this->last_read_ > this->read_timeout_)
+    if (this->streaming_)
+      this->stream_decrypt_();
+
+    // A streamed frame is complete as soon as its last byte is in; otherwise wait for the line to go quiet
+    bool complete = this->stream_.state == StreamState::DECRYPTING &&
+                    this->receive_buffer_.size() >= this->stream_.frame_size;
+    return !this->receive_buffer_.empty() && (complete || this->source_->quiet());
+  }
+
+  void GplugkComponent::run_stages_(uint32_t start)
+  {
+    // Run steps until the frame is done or the budget is spent; the rest resumes in the next loop()
+    this->job_.iterations++;
+    do
     {
-      this->dlms_data_.clear();
-      if (!this->parse_hdlc_(this->dlms_data_))
-        return;
+      uint32_t step_start = micros();
+      uint8_t stage = this->job_.stage;
+      this->step_();
+      uint32_t elapsed = micros() - step_start;
+      if (elapsed > this->job_.slowest_step_time)
+      {
+        this->job_.slowest_step_time = elapsed;
+        this->job_.slowest_stage = stage;
+      }
+      if (elapsed > this->loop_budget_us_)
+      {
+        // A single step cannot be split any further
+        this->budget_overruns_++;
+        ESP_LOGD(TAG, "Stage %u took %u us (budget %u us)", stage, elapsed, this->loop_budget_us_);
+      }
+    } while (this->job_.stage != FrameJob::IDLE && micros() - start < this->loop_budget_us_);
+  }
 
-      uint16_t message_length;
-      uint8_t systitle_length;
-      uint16_t header_offset;
-      if (!this->parse_dlms_(this->dlms_data_, message_length, systitle_length, header_offset))
-        return;
+  void GplugkComponent::step_()
+  {
+    FrameJob &job = this->job_;
+    switch (job.stage)
+    {
+    case FrameJob::VALIDATE:
+      if (!this->validate_frame_())
+        return this->end_frame_();
+      job.stage = job.plaintext != nullptr ? FrameJob::DECODE : FrameJob::DECRYPT;
+      break;
+
+    case FrameJob::DECRYPT:
+      if (!this->decrypt_(this->dlms_data_, job.message_length, job.header_offset))
+        return this->end_frame_();
+      job.plaintext = &this->dlms_data_[job.header_offset + DLMS_PAYLOAD_OFFSET];
+      job.stage = FrameJob::DECODE;
+      break;
+
+    case FrameJob::DECODE:
+      // Strip data-notification APDU header from decrypted payload
+      if (!this->decode_cosem_(job.plaintext + DATA_NOTIFICATION_HEADER_SIZE,
+                               job.message_length - DATA_NOTIFICATION_HEADER_SIZE))
+        return this->end_frame_();
+      job.stage = FrameJob::PUBLISH;
+      break;
+
+    case FrameJob::PUBLISH:
+      // One sensor per step, skipping fields without a sensor or not in this frame
+      while (job.next_field < MeterField::FIELD_COUNT && !this->publish_field_(this->meter_, job.next_field++))
+        ;
+      if (job.next_field == MeterField::FIELD_COUNT)
+        job.stage = FrameJob::HISTORY;
+      break;
+
+    case FrameJob::HISTORY:
+#ifdef USE_GPLUGK_HISTORY
+      this->record_history_(this->meter_);
+#endif
+      job.stage = FrameJob::ENERGY_LOG;
+      break;
+
+    case FrameJob::ENERGY_LOG:
+      job.stage = FrameJob::DIAGNOSTICS;
+#ifdef USE_GPLUGK_ENERGY_LOG
+      this->record_energy_(this->meter_);
+      if (this->energy_log_ready_ && this->energy_log_.needs_erase())
+        job.stage = FrameJob::ERASE;
+#endif
+      break;
+
+    case FrameJob::ERASE:
+      // A sector erase cannot be split and usually takes longer than the budget
+#ifdef USE_GPLUGK_ENERGY_LOG
+    {
+      LockGuard guard(this->energy_lock_);
+      if (!this->energy_log_.erase_next())
+        ESP_LOGW(TAG, "Energy log: erase failed");
+    }
+#endif
+      job.stage = FrameJob::DIAGNOSTICS;
+      break;
 
-      if (message_length > MAX_MESSAGE_LENGTH)
+    case FrameJob::DIAGNOSTICS:
+      // Everything before this stage counts towards the frame
+      if (job.next_diagnostic == 0)
       {
-        ESP_LOGE(TAG, "DLMS: Message length invalid: %u", message_length);
-        this->receive_buffer_.clear();
+        this->frame_iterations_ = job.iterations;
+        this->slowest_step_time_ = job.slowest_step_time;
+        this->slowest_stage_ = job.slowest_stage;
+      }
+      while (job.next_diagnostic < DIAGNOSTIC_SENSOR_COUNT && !this->publish_diagnostic_(job.next_diagnostic++))
+        ;
+      if (job.next_diagnostic == DIAGNOSTIC_SENSOR_COUNT)
+      {
+        this->status_clear_warning();
+        this->end_frame_();
+      }
+      break;
+
+    case FrameJob::IDLE:
+      break;
+    }
+  }
+
+  void GplugkComponent::end_frame_()
+  {
+    ESP_LOGV(TAG, "Frame done after %u loop iterations", this->job_.iterations);
+    this->receive_buffer_.clear();
+    this->stream_ = StreamState{};
+    this->job_.stage = FrameJob::IDLE;
+  }
+
+  bool GplugkComponent::validate_frame_()
+  {
+    this->dlms_data_.clear();
+    if (!this->parse_hdlc_(this->dlms_data_))
+      return false;
+
+    FrameJob &job = this->job_;
+    uint8_t systitle_length;
+    if (!this->parse_dlms_(this->dlms_data_, job.message_length, systitle_length, job.header_offset))
+      return false;
+
+    if (job.message_length > MAX_MESSAGE_LENGTH)
+    {
+      ESP_LOGE(TAG, "DLMS: Message length invalid: %u", job.message_length);
+      return false;
+    }
+
+    if (this->stream_.state == StreamState::NO_KEY)
+    {
+      // Every key was already tried on this frame during reception
+      ESP_LOGE(TAG, "COSEM: No decryption key matches the frame");
+      return false;
+    }
+    if (this->stream_.state == StreamState::DECRYPTING && this->stream_.decrypted == job.message_length)
+    {
+      // Already decrypted during reception
+      job.plaintext = this->plaintext_.data();
+      return this->check_plaintext_(job.plaintext, job.message_length);
+    }
+    job.plaintext = nullptr;
+    return true;
+  }
+
+  void GplugkComponent::stream_decrypt_()
+  {
+    if (this->stream_.state == StreamState::WAIT_HEADER)
+    {
+      if (this->receive_buffer_.size() < STREAM_HEADER_SIZE)
+        return;
+      if (!this->start_stream_())
+      {
+        // Not an error yet: the full validation after the read timeout reports the cause
+        this->stream_.state = StreamState::DECLINED;
         return;
       }
+    }
+    if (this->stream_.state != StreamState::DECRYPTING)
+      return;
 
-      if (!this->decrypt_(this->dlms_data_, message_length, systitle_length, header_offset))
+    // Feed whole GCM blocks only; the final partial block once the payload is complete
+    uint16_t pos = this->stream_.payload_start + this->stream_.decrypted;
+    uint16_t end = std::min<size_t>(this->receive_buffer_.size(), this->stream_.payload_end);
+    if (end <= pos)
+      return;
+
+    // The first block picks the key; a wrong key or corrupt header stops early
+    if (this->stream_.decrypted == 0)
+    {
+      if (end - pos < GCM_BLOCK_SIZE)
+        return;
+      const uint8_t *dlms = &this->receive_buffer_[HDLC_INFO_OFFSET + LLC_HEADER_SIZE];
+      if (!this->decrypt_first_block_(dlms, this->stream_.header_offset, &this->receive_buffer_[pos],
+                                      this->plaintext_.data()))
+      {
+        this->stream_.state = StreamState::NO_KEY;
         return;
+      }
+      this->stream_.decrypted = GCM_BLOCK_SIZE;
+      pos += GCM_BLOCK_SIZE;
+      if (end <= pos)
+        return;
+    }
+    uint16_t length = end - pos;
+    if (end != this->stream_.payload_end)
+      length -= length % GCM_BLOCK_SIZE;
+    if (length == 0)
+      return;
 
-      // Strip data-notification APDU header from decrypted payload
-      this->decode_cosem_(
-          &this->dlms_data_[header_offset + DLMS_PAYLOAD_OFFSET + DATA_NOTIFICATION_HEADER_SIZE],
-          message_length - DATA_NOTIFICATION_HEADER_SIZE);
+    size_t outlen = 0;
+    uint8_t *out = &this->plaintext_[this->stream_.decrypted];
+    if (mbedtls_gcm_update(&this->keyring_[this->active_key_].ctx, &this->receive_buffer_[pos], length, out, length,
+                           &outlen) != 0 ||
+        outlen != length)
+    {
+      this->stream_.state = StreamState::DECLINED;
+      return;
     }
+    this->stream_.decrypted += length;
+  }
+
+  bool GplugkComponent::start_stream_()
+  {
+    const uint8_t *frame = this->receive_buffer_.data();
+    uint16_t frame_size = hdlc_frame_size(frame);
+    if (frame_size == 0 || frame_size > HDLC_MAX_FRAME_SIZE)
+      return false;
+
+    if (memcmp(&frame[HDLC_INFO_OFFSET], LLC_HEADER, LLC_HEADER_SIZE) != 0)
+      return false;
+
+    const uint8_t *dlms = &frame[HDLC_INFO_OFFSET + LLC_HEADER_SIZE];
+    uint16_t message_length;
+    uint16_t header_offset;
+    if (!dlms_parse_header(dlms, message_length, header_offset) || message_length < GCM_BLOCK_SIZE ||
+        message_length > MAX_MESSAGE_LENGTH)
+      return false;
+
+    // DLMS APDU spans from after the LLC header up to the FCS and closing flag
+    uint16_t dlms_length = frame_size - HDLC_INFO_OFFSET - LLC_HEADER_SIZE - 3;
+    if (dlms_length != DLMS_HEADER_LENGTH + header_offset + message_length)
+      return false;
+
+    this->stream_.state = StreamState::DECRYPTING;
+    this->stream_.frame_size = frame_size;
+    this->stream_.header_offset = header_offset;
+    this->stream_.payload_start = HDLC_INFO_OFFSET + LLC_HEADER_SIZE + header_offset + DLMS_PAYLOAD_OFFSET;
+    this->stream_.payload_end = this->stream_.payload_start + message_length;
+    this->stream_.decrypted = 0;
+    ESP_LOGV(TAG, "Streaming decryption of %u byte payload", message_length);
+    return true;
   }
 
   bool GplugkComponent::parse_hdlc_(std::vector<uint8_t> &dlms_data)
@@ -242,25 +580,154 @@ namespace esphome::gplugk
     return true;
   }
 
-  bool GplugkComponent::decrypt_(std::vector<uint8_t> &dlms_data, uint16_t message_length, uint8_t systitle_length,
-                                 uint16_t header_offset)
+  void GplugkComponent::start_decrypt_(uint8_t key, const uint8_t *dlms, uint16_t header_offset)
   {
-    ESP_LOGV(TAG, "Decrypting payload (%u bytes)", message_length);
-
     // Build IV: system title (8 bytes) + frame counter (4 bytes)
     uint8_t iv[12];
-    memcpy(&iv[0], &dlms_data[DLMS_SYST_OFFSET + 1], systitle_length);
-    memcpy(&iv[8], &dlms_data[header_offset + DLMS_FRAMECOUNTER_OFFSET], DLMS_FRAMECOUNTER_LENGTH);
+    memcpy(&iv[0], &dlms[DLMS_SYST_OFFSET + 1], 8);
+    memcpy(&iv[8], &dlms[header_offset + DLMS_FRAMECOUNTER_OFFSET], DLMS_FRAMECOUNTER_LENGTH);
+    mbedtls_gcm_starts(&this->keyring_[key].ctx, MBEDTLS_GCM_DECRYPT, iv, sizeof(iv));
+  }
+
+  bool GplugkComponent::decrypt_first_block_(const uint8_t *dlms, uint16_t header_offset, const uint8_t *ciphertext,
+                                             uint8_t *plaintext)
+  {
+    // Steady state: the last key that worked decrypts the block and the frame continues with it
+    size_t outlen = 0;
+    this->start_decrypt_(this->active_key_, dlms, header_offset);
+    if (mbedtls_gcm_update(&this->keyring_[this->active_key_].ctx, ciphertext, GCM_BLOCK_SIZE, plaintext,
+                           GCM_BLOCK_SIZE, &outlen) == 0 &&
+        data_notification_start_valid(plaintext))
+      return true;
+
+    // Without an authentication key the tag cannot be checked, so the known plaintext
+    // at the start of the data-notification tells the keys apart
+    for (uint8_t key = 0; key < this->key_count_; key++)
+    {
+      if (key == this->active_key_)
+        continue;
+      this->key_fallbacks_++;
+      this->start_decrypt_(key, dlms, header_offset);
+      if (mbedtls_gcm_update(&this->keyring_[key].ctx, ciphertext, GCM_BLOCK_SIZE, plaintext, GCM_BLOCK_SIZE,
+                             &outlen) != 0 ||
+          !data_notification_start_valid(plaintext))
+        continue;
+
+      ESP_LOGW(TAG, "Decryption key %u no longer matches, switching to key %u", this->active_key_ + 1, key + 1);
+      this->active_key_ = key;
+      this->key_switches_++;
+      this->publish_diagnostics_();
+      return true;
+    }
+    this->publish_diagnostics_();
+    return false;
+  }
+
+  bool GplugkComponent::expand_key_(uint8_t key)
+  {
+    auto &entry = this->keyring_[key];
+    int ret = mbedtls_gcm_setkey(&entry.ctx, MBEDTLS_CIPHER_ID_AES, entry.key.data(), entry.key.size() * 8);
+    if (ret != 0)
+      ESP_LOGE(TAG, "Expanding decryption key %u failed with error: %d", key + 1, ret);
+    return ret == 0;
+  }
+
+#ifdef USE_GPLUGK_RUNTIME_KEY
+  void GplugkComponent::on_set_decryption_key_(std::string key)
+  {
+    RuntimeKey stored{};
+    uint8_t slot = this->compiled_keys_;
+    if (key.empty())
+    {
+      // Drop the runtime key and fall back to the compiled-in ones
+      this->key_count_ = slot;
+      this->active_key_ = 0;
+      this->keyring_changed_();
+      this->runtime_key_pref_.save(&stored);
+      ESP_LOGI(TAG, "Runtime decryption key cleared");
+      return;
+    }
+
+    if (!parse_hex(key, stored.key, sizeof(stored.key)))
+    {
+      ESP_LOGE(TAG, "Runtime decryption key must be 32 hex characters");
+      return;
+    }
+    std::copy(std::begin(stored.key), std::end(stored.key), this->keyring_[slot].key.begin());
+    this->keyring_changed_();
+    if (!this->expand_key_(slot))
+    {
+      this->key_count_ = slot;
+      this->active_key_ = 0;
+      return;
+    }
+    this->key_count_ = slot + 1;
+    this->active_key_ = slot;
+    stored.set = true;
+    this->runtime_key_pref_.save(&stored);
+    ESP_LOGI(TAG, "Runtime decryption key set");
+  }
+
+  void GplugkComponent::keyring_changed_()
+  {
+    // The GCM context of a frame being decrypted during reception may have been re-keyed;
+    // decrypt that frame again from the start once it is complete
+    if (this->stream_.state == StreamState::DECRYPTING || this->stream_.state == StreamState::NO_KEY)
+      this->stream_.state = StreamState::DECLINED;
+  }
+#endif
+
+  void GplugkComponent::publish_diagnostics_()
+  {
+#define GPLUGK_PUBLISH_DIAGNOSTIC(s) \
+  if (this->s##_sensor_ != nullptr) \
+    this->s##_sensor_->publish_state(this->s##_);
+    GPLUGK_DIAGNOSTIC_SENSOR_LIST(GPLUGK_PUBLISH_DIAGNOSTIC, )
+  }
+
+  bool GplugkComponent::publish_diagnostic_(uint8_t index)
+  {
+    // True if a sensor was published, like publish_field_()
+    uint8_t i = 0;
+#define GPLUGK_PUBLISH_DIAGNOSTIC_AT(s)                    \
+  if (i++ == index && this->s##_sensor_ != nullptr)        \
+  {                                                        \
+    this->s##_sensor_->publish_state(this->s##_);          \
+    return true;                                           \
+  }
+    GPLUGK_DIAGNOSTIC_SENSOR_LIST(GPLUGK_PUBLISH_DIAGNOSTIC_AT, )
+    return false;
+  }
+
+  bool GplugkComponent::decrypt_(std::vector<uint8_t> &dlms_data, uint16_t message_length, uint16_t header_offset)
+  {
+    ESP_LOGV(TAG, "Decrypting payload (%u bytes)", message_length);
 
     uint8_t *payload_ptr = &dlms_data[header_offset + DLMS_PAYLOAD_OFFSET];
 
+    // Pick the key on the first block, then decrypt the rest in place with it
+    uint16_t offset = 0;
+    if (message_length >= GCM_BLOCK_SIZE)
+    {
+      uint8_t block[GCM_BLOCK_SIZE];
+      if (!this->decrypt_first_block_(dlms_data.data(), header_offset, payload_ptr, block))
+      {
+        ESP_LOGE(TAG, "COSEM: No decryption key matches the frame");
+        this->receive_buffer_.clear();
+        return false;
+      }
+      memcpy(payload_ptr, block, sizeof(block));
+      offset = GCM_BLOCK_SIZE;
+    }
+    else
+    {
+      this->start_decrypt_(this->active_key_, dlms_data.data(), header_offset);
+    }
+
     size_t outlen = 0;
-    mbedtls_gcm_context gcm_ctx;
-    mbedtls_gcm_init(&gcm_ctx);
-    mbedtls_gcm_setkey(&gcm_ctx, MBEDTLS_CIPHER_ID_AES, this->decryption_key_.data(), this->decryption_key_.size() * 8);
-    mbedtls_gcm_starts(&gcm_ctx, MBEDTLS_GCM_DECRYPT, iv, sizeof(iv));
-    auto ret = mbedtls_gcm_update(&gcm_ctx, payload_ptr, message_length, payload_ptr, message_length, &outlen);
-    mbedtls_gcm_free(&gcm_ctx);
+    uint16_t length = message_length - offset;
+    auto ret = mbedtls_gcm_update(&this->keyring_[this->active_key_].ctx, payload_ptr + offset, length,
+                                  payload_ptr + offset, length, &outlen);
 
     if (ret != 0)
     {
@@ -269,6 +736,11 @@ namespace esphome::gplugk
       return false;
     }
 
+    return this->check_plaintext_(payload_ptr, message_length);
+  }
+
+  bool GplugkComponent::check_plaintext_(const uint8_t *payload_ptr, uint16_t message_length)
+  {
     // Log decrypted payload for debugging (hex dump)
     if (ESPHOME_LOG_LEVEL >= ESPHOME_LOG_LEVEL_VERBOSE) {
       char hex_buf[message_length * 3 + 1];
@@ -291,25 +763,223 @@ namespace esphome::gplugk
     return true;
   }
 
-  void GplugkComponent::decode_cosem_(uint8_t *plaintext, uint16_t message_length)
+  // MeterField index for a numeric OBIS value, -1 if not decoded
+  static int obis_field(uint16_t obis_cd)
+  {
+    switch (obis_cd)
+    {
+#define GPLUGK_OBIS_CASE(name, obis, quantity) \
+  case obis:                                   \
+    return MeterField::name;
+      GPLUGK_METER_FIELDS(GPLUGK_OBIS_CASE)
+    default:
+      return -1;
+    }
+  }
+
+  // Days-from-civil conversion, valid for the proleptic Gregorian calendar
+  static uint32_t unix_time(uint16_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t minute, uint8_t second)
+  {
+    int32_t y = year - (month <= 2);
+    int32_t era = (y >= 0 ? y : y - 399) / 400;
+    uint32_t yoe = y - era * 400;
+    uint32_t doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    uint32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    int32_t days = era * 146097 + static_cast<int32_t>(doe) - 719468;
+    return static_cast<uint32_t>(days) * 86400 + hour * 3600 + minute * 60 + second;
+  }
+
+  static void decode_timestamp(const uint8_t *value, MeterData &data)
+  {
+    uint16_t year = encode_uint16(value[0], value[1]);
+    uint8_t month = value[2];
+    uint8_t day = value[3];
+    // value[4] is day-of-week, skip
+    uint8_t hour = value[5];
+    uint8_t minute = value[6];
+    uint8_t second = value[7];
+
+    if (year <= 9999 && month <= 12 && day <= 31 && hour <= 23 && minute <= 59 && second <= 59)
+    {
+      snprintf(data.timestamp, sizeof(data.timestamp), "%04u-%02u-%02uT%02u:%02u:%02uZ",
+               year, month, day, hour, minute, second);
+      data.time = unix_time(year, month, day, hour, minute, second);
+      data.mark(MeterField::timestamp);
+    }
+    else
+    {
+      ESP_LOGW(TAG, "COSEM: Invalid timestamp values");
+    }
+  }
+
+  GplugkComponent::FrameLayout::Entry GplugkComponent::FrameLayout::Entry::from(const uint8_t *plaintext,
+                                                                                 uint16_t offset, uint8_t field)
+  {
+    Entry entry;
+    entry.offset = offset;
+    memcpy(entry.header, &plaintext[offset], sizeof(entry.header));
+    entry.string_length = entry.header[TYPE_INDEX] == DataType::OCTET_STRING ? plaintext[offset + HEADER_SIZE] : 0;
+    entry.field = field;
+    return entry;
+  }
+
+  bool GplugkComponent::decode_cosem_(uint8_t *plaintext, uint16_t message_length)
+  {
+    // Values not carried by this frame keep their last known state and are not published
+    MeterData &data = this->meter_;
+    data.present = 0;
+    if (!this->decode_cached_(plaintext, message_length, data) && !this->parse_cosem_(plaintext, message_length, data))
+      return false;
+    this->derive_(data);
+
+    ESP_LOGI(TAG, "Received valid Kamstrup data");
+    return true;
+  }
+
+  void GplugkComponent::store_value_(MeterData &data, uint8_t field, uint32_t raw)
+  {
+    data.set(field, raw, static_cast<float>(raw) * this->scales_[field]);
+  }
+
+  void GplugkComponent::derive_(MeterData &data)
+  {
+    // Only from values carried by this frame, so a derived value never mixes two push lists
+    if (data.has(MeterField::active_power_plus) && data.has(MeterField::active_power_minus))
+    {
+      // From the raw counters: a scale override on either sensor must not skew the difference
+      data.values[MeterField::net_power] = (static_cast<float>(data.raw[MeterField::active_power_plus]) -
+                                            static_cast<float>(data.raw[MeterField::active_power_minus])) *
+                                           this->power_scale_;
+      data.mark(MeterField::net_power);
+      data.grid_export = data.raw[MeterField::active_power_minus] > data.raw[MeterField::active_power_plus];
+      data.mark(MeterField::grid_export);
+
+      if (data.has(MeterField::reactive_power_plus) && data.has(MeterField::reactive_power_minus))
+      {
+        // tan(phi); undefined without active power
+        uint32_t active = data.raw[MeterField::active_power_plus] + data.raw[MeterField::active_power_minus];
+        uint32_t reactive = data.raw[MeterField::reactive_power_plus] + data.raw[MeterField::reactive_power_minus];
+        if (active > 0)
+        {
+          data.values[MeterField::reactive_ratio] = static_cast<float>(reactive) / active;
+          data.mark(MeterField::reactive_ratio);
+        }
+      }
+    }
+
+    static constexpr uint8_t PHASES[3][3] = {
+        {MeterField::voltage_l1, MeterField::current_l1, MeterField::apparent_power_l1},
+        {MeterField::voltage_l2, MeterField::current_l2, MeterField::apparent_power_l2},
+        {MeterField::voltage_l3, MeterField::current_l3, MeterField::apparent_power_l3},
+    };
+    float apparent_total = 0.0f;
+    uint32_t current_min = UINT32_MAX;
+    uint32_t current_max = 0;
+    uint32_t current_sum = 0;
+    uint8_t phases = 0;
+    for (const auto &phase : PHASES)
+    {
+      if (!data.has(phase[0]) || !data.has(phase[1]))
+        continue;
+      uint32_t current = data.raw[phase[1]];
+      float apparent = static_cast<float>(data.raw[phase[0]]) * current * this->apparent_power_scale_;
+      data.values[phase[2]] = apparent;
+      data.mark(phase[2]);
+      apparent_total += apparent;
+      current_min = std::min(current_min, current);
+      current_max = std::max(current_max, current);
+      current_sum += current;
+      phases++;
+    }
+    if (phases == 3)
+    {
+      data.values[MeterField::apparent_power] = apparent_total;
+      data.mark(MeterField::apparent_power);
+      // Spread of the phase currents relative to their mean, in percent
+      data.values[MeterField::current_imbalance] =
+          current_sum > 0 ? 300.0f * (current_max - current_min) / current_sum : 0.0f;
+      data.mark(MeterField::current_imbalance);
+    }
+  }
+
+  bool GplugkComponent::decode_cached_(const uint8_t *plaintext, uint16_t message_length, MeterData &data)
+  {
+    for (const auto &layout : this->layouts_)
+    {
+      if (layout.matches(plaintext, message_length) && this->decode_layout_(layout, plaintext, data))
+        return true;
+    }
+    return false;
+  }
+
+  bool GplugkComponent::decode_layout_(const FrameLayout &layout, const uint8_t *plaintext, MeterData &data)
+  {
+    // Fingerprint: every cached entry still has the same OBIS code, type and string length
+    for (const auto &entry : layout.entries)
+    {
+      if (memcmp(&plaintext[entry.offset], entry.header, sizeof(entry.header)) != 0 ||
+          (entry.string_length != 0 && plaintext[entry.offset + FrameLayout::HEADER_SIZE] != entry.string_length))
+      {
+        ESP_LOGD(TAG, "COSEM: Frame layout changed at offset %u", entry.offset);
+        return false;
+      }
+    }
+
+    // Meter name follows the STRUCTURE and VISIBLE_STRING headers
+    uint8_t name_length = layout.prefix[3];
+    uint8_t copy_len = name_length < sizeof(data.meter_name) - 1 ? name_length : sizeof(data.meter_name) - 1;
+    memcpy(data.meter_name, &plaintext[sizeof(layout.prefix)], copy_len);
+    data.meter_name[copy_len] = '\0';
+    data.mark(MeterField::meter_name);
+
+    for (const auto &entry : layout.entries)
+    {
+      const uint8_t *value = &plaintext[entry.offset + FrameLayout::HEADER_SIZE];
+      switch (entry.header[FrameLayout::TYPE_INDEX])
+      {
+      case DataType::DOUBLE_LONG_UNSIGNED:
+        this->store_value_(data, entry.field, encode_uint32(value[0], value[1], value[2], value[3]));
+        break;
+      case DataType::LONG_UNSIGNED:
+        this->store_value_(data, entry.field, encode_uint16(value[0], value[1]));
+        break;
+      default:
+        decode_timestamp(value + 1, data);
+        break;
+      }
+    }
+
+    ESP_LOGV(TAG, "COSEM: Decoded %u values from cached layout", (unsigned)layout.entries.size());
+    return true;
+  }
+
+  bool GplugkComponent::parse_cosem_(const uint8_t *plaintext, uint16_t message_length, MeterData &data)
   {
     ESP_LOGV(TAG, "Decoding COSEM structure");
-    MeterData data{};
+    // Rebuild the layout of this shape if there is one, otherwise replace the oldest
+    FrameLayout *layout = &this->layouts_[this->next_layout_];
+    for (auto &candidate : this->layouts_)
+    {
+      if (candidate.matches(plaintext, message_length))
+        layout = &candidate;
+    }
+    if (layout == &this->layouts_[this->next_layout_])
+      this->next_layout_ = (this->next_layout_ + 1) % MAX_FRAME_LAYOUTS;
+    layout->valid = false;
+    layout->entries.clear();
     uint16_t pos = 0;
 
     // Parse STRUCTURE header
     if (pos + 2 > message_length)
     {
       ESP_LOGE(TAG, "COSEM: Too short for structure header");
-      this->receive_buffer_.clear();
-      return;
+      return false;
     }
 
     if (plaintext[pos] != DataType::STRUCTURE)
     {
       ESP_LOGE(TAG, "COSEM: Expected STRUCTURE, got 0x%02X", plaintext[pos]);
-      this->receive_buffer_.clear();
-      return;
+      return false;
     }
     pos++;
 
@@ -321,15 +991,13 @@ namespace esphome::gplugk
     if (pos + 2 > message_length)
     {
       ESP_LOGE(TAG, "COSEM: Too short for meter name header");
-      this->receive_buffer_.clear();
-      return;
+      return false;
     }
 
     if (plaintext[pos] != DataType::VISIBLE_STRING)
     {
       ESP_LOGE(TAG, "COSEM: Expected VISIBLE_STRING for meter name, got 0x%02X", plaintext[pos]);
-      this->receive_buffer_.clear();
-      return;
+      return false;
     }
     pos++;
 
@@ -339,13 +1007,13 @@ namespace esphome::gplugk
     if (pos + name_length > message_length)
     {
       ESP_LOGE(TAG, "COSEM: Buffer too short for meter name");
-      this->receive_buffer_.clear();
-      return;
+      return false;
     }
 
     uint8_t copy_len = name_length < sizeof(data.meter_name) - 1 ? name_length : sizeof(data.meter_name) - 1;
     memcpy(data.meter_name, &plaintext[pos], copy_len);
     data.meter_name[copy_len] = '\0';
+    data.mark(MeterField::meter_name);
     pos += name_length;
 
     ESP_LOGV(TAG, "COSEM: Meter name: %s", data.meter_name);
@@ -363,11 +1031,11 @@ namespace esphome::gplugk
         break;
       }
 
+      uint16_t entry_start = pos;
       if (plaintext[pos] != DataType::OCTET_STRING)
       {
         ESP_LOGE(TAG, "COSEM: Expected OCTET_STRING for OBIS code at entry %d, got 0x%02X", entry, plaintext[pos]);
-        this->receive_buffer_.clear();
-        return;
+        return false;
       }
       pos++;
 
@@ -377,18 +1045,16 @@ namespace esphome::gplugk
       if (obis_len != 6)
       {
         ESP_LOGE(TAG, "COSEM: Unexpected OBIS code length: %u", obis_len);
-        this->receive_buffer_.clear();
-        return;
+        return false;
       }
 
       if (pos + 6 > message_length)
       {
         ESP_LOGE(TAG, "COSEM: Buffer too short for OBIS code");
-        this->receive_buffer_.clear();
-        return;
+        return false;
       }
 
-      uint8_t *obis_code = &plaintext[pos];
+      const uint8_t *obis_code = &plaintext[pos];
       uint16_t obis_cd = (obis_code[OBIS_C] << 8) | obis_code[OBIS_D];
       pos += 6;
 
@@ -396,14 +1062,13 @@ namespace esphome::gplugk
       if (pos >= message_length)
       {
         ESP_LOGE(TAG, "COSEM: Buffer too short for data type");
-        this->receive_buffer_.clear();
-        return;
+        return false;
       }
 
       uint8_t data_type = plaintext[pos];
       pos++;
 
-      float value = 0.0f;
+      uint32_t value = 0;
       bool is_numeric = false;
 
       switch (data_type)
@@ -413,11 +1078,9 @@ namespace esphome::gplugk
         if (pos + 4 > message_length)
         {
           ESP_LOGE(TAG, "COSEM: Buffer too short for DOUBLE_LONG_UNSIGNED");
-          this->receive_buffer_.clear();
-          return;
+          return false;
         }
-        value = static_cast<float>(encode_uint32(plaintext[pos], plaintext[pos + 1],
-                                                 plaintext[pos + 2], plaintext[pos + 3]));
+        value = encode_uint32(plaintext[pos], plaintext[pos + 1], plaintext[pos + 2], plaintext[pos + 3]);
         pos += 4;
         is_numeric = true;
         break;
@@ -427,10 +1090,9 @@ namespace esphome::gplugk
         if (pos + 2 > message_length)
         {
           ESP_LOGE(TAG, "COSEM: Buffer too short for LONG_UNSIGNED");
-          this->receive_buffer_.clear();
-          return;
+          return false;
         }
-        value = static_cast<float>(encode_uint16(plaintext[pos], plaintext[pos + 1]));
+        value = encode_uint16(plaintext[pos], plaintext[pos + 1]);
         pos += 2;
         is_numeric = true;
         break;
@@ -440,8 +1102,7 @@ namespace esphome::gplugk
         if (pos >= message_length)
         {
           ESP_LOGE(TAG, "COSEM: Buffer too short for OCTET_STRING length");
-          this->receive_buffer_.clear();
-          return;
+          return false;
         }
         uint8_t data_length = plaintext[pos];
         pos++;
@@ -449,149 +1110,238 @@ namespace esphome::gplugk
         if (pos + data_length > message_length)
         {
           ESP_LOGE(TAG, "COSEM: Buffer too short for OCTET_STRING data");
-          this->receive_buffer_.clear();
-          return;
+          return false;
         }
 
         // Timestamp: 12-byte OCTET_STRING with date-time
         if (obis_cd == OBIS_TIMESTAMP && data_length >= 8)
         {
-          uint16_t year = encode_uint16(plaintext[pos], plaintext[pos + 1]);
-          uint8_t month = plaintext[pos + 2];
-          uint8_t day = plaintext[pos + 3];
-          // pos+4 is day-of-week, skip
-          uint8_t hour = plaintext[pos + 5];
-          uint8_t minute = plaintext[pos + 6];
-          uint8_t second = plaintext[pos + 7];
-
-          if (year <= 9999 && month <= 12 && day <= 31 && hour <= 23 && minute <= 59 && second <= 59)
-          {
-            snprintf(data.timestamp, sizeof(data.timestamp), "%04u-%02u-%02uT%02u:%02u:%02uZ",
-                     year, month, day, hour, minute, second);
-          }
-          else
-          {
-            ESP_LOGW(TAG, "COSEM: Invalid timestamp values");
-          }
+          decode_timestamp(&plaintext[pos], data);
+          layout->entries.push_back(FrameLayout::Entry::from(plaintext, entry_start, MeterField::timestamp));
         }
         pos += data_length;
         break;
       }
       default:
         ESP_LOGW(TAG, "COSEM: Unknown data type 0x%02X at entry %d", data_type, entry);
-        this->receive_buffer_.clear();
-        return;
+        return false;
       }
 
       // Map numeric values to MeterData fields
       if (is_numeric)
       {
-        switch (obis_cd)
+        int field = obis_field(obis_cd);
+        if (field < 0)
         {
-        case OBIS_ACTIVE_ENERGY_PLUS:
-          data.active_energy_plus = value;
-          break;
-        case OBIS_ACTIVE_ENERGY_MINUS:
-          data.active_energy_minus = value;
-          break;
-        case OBIS_REACTIVE_ENERGY_PLUS:
-          data.reactive_energy_plus = value;
-          break;
-        case OBIS_REACTIVE_ENERGY_MINUS:
-          data.reactive_energy_minus = value;
-          break;
-        case OBIS_METER_ID:
-          data.meter_id = value;
-          break;
-        case OBIS_ACTIVE_POWER_PLUS:
-          data.active_power_plus = value;
-          break;
-        case OBIS_ACTIVE_POWER_MINUS:
-          data.active_power_minus = value;
-          break;
-        case OBIS_REACTIVE_POWER_PLUS:
-          data.reactive_power_plus = value;
-          break;
-        case OBIS_REACTIVE_POWER_MINUS:
-          data.reactive_power_minus = value;
-          break;
-        case OBIS_VOLTAGE_L1:
-          data.voltage_l1 = value;
-          break;
-        case OBIS_VOLTAGE_L2:
-          data.voltage_l2 = value;
-          break;
-        case OBIS_VOLTAGE_L3:
-          data.voltage_l3 = value;
-          break;
-        case OBIS_CURRENT_L1:
-          data.current_l1 = value;
-          break;
-        case OBIS_CURRENT_L2:
-          data.current_l2 = value;
-          break;
-        case OBIS_CURRENT_L3:
-          data.current_l3 = value;
-          break;
-        case OBIS_ACTIVE_POWER_L1:
-          data.active_power_l1 = value;
-          break;
-        case OBIS_ACTIVE_POWER_L2:
-          data.active_power_l2 = value;
-          break;
-        case OBIS_ACTIVE_POWER_L3:
-          data.active_power_l3 = value;
-          break;
-        case OBIS_ACTIVE_POWER_MINUS_L1:
-          data.active_power_minus_l1 = value;
-          break;
-        case OBIS_ACTIVE_POWER_MINUS_L2:
-          data.active_power_minus_l2 = value;
-          break;
-        case OBIS_ACTIVE_POWER_MINUS_L3:
-          data.active_power_minus_l3 = value;
-          break;
-        case OBIS_POWER_FACTOR:
-          data.power_factor = value;
-          break;
-        case OBIS_POWER_FACTOR_L1:
-          data.power_factor_l1 = value;
-          break;
-        case OBIS_POWER_FACTOR_L2:
-          data.power_factor_l2 = value;
-          break;
-        case OBIS_POWER_FACTOR_L3:
-          data.power_factor_l3 = value;
-          break;
-        case OBIS_ACTIVE_ENERGY_PLUS_L1:
-          data.active_energy_plus_l1 = value;
-          break;
-        case OBIS_ACTIVE_ENERGY_PLUS_L2:
-          data.active_energy_plus_l2 = value;
-          break;
-        case OBIS_ACTIVE_ENERGY_PLUS_L3:
-          data.active_energy_plus_l3 = value;
-          break;
-        case OBIS_ACTIVE_ENERGY_MINUS_L1:
-          data.active_energy_minus_l1 = value;
-          break;
-        case OBIS_ACTIVE_ENERGY_MINUS_L2:
-          data.active_energy_minus_l2 = value;
-          break;
-        case OBIS_ACTIVE_ENERGY_MINUS_L3:
-          data.active_energy_minus_l3 = value;
-          break;
-        default:
           ESP_LOGW(TAG, "COSEM: Unknown OBIS CD 0x%04X", obis_cd);
+          continue;
         }
+        this->store_value_(data, field, value);
+        layout->entries.push_back(FrameLayout::Entry::from(plaintext, entry_start, field));
       }
     }
 
-    this->receive_buffer_.clear();
+    // Same shape next time: remember where everything was
+    layout->message_length = message_length;
+    memcpy(layout->prefix, plaintext, sizeof(layout->prefix));
+    layout->valid = true;
+    return true;
+  }
 
-    ESP_LOGI(TAG, "Received valid Kamstrup data");
-    this->publish_sensors(data);
-    this->status_clear_warning();
+#ifdef USE_GPLUGK_HISTORY
+  void GplugkComponent::record_history_(const MeterData &data)
+  {
+    LockGuard guard(this->history_lock_);
+    uint32_t time = this->history_uptime_();
+
+    size_t channel = 0;
+#define GPLUGK_RECORD_HISTORY(s)                                   \
+  if (data.has(MeterField::s))                                     \
+    this->history_[channel].append(time, data.raw[MeterField::s]); \
+  channel++;
+    GPLUGK_HISTORY_LIST(GPLUGK_RECORD_HISTORY, )
+  }
+
+  uint32_t GplugkComponent::history_uptime_()
+  {
+    // Seconds since boot, accumulated so the timebase survives the 49-day millis() wrap
+    uint32_t now = millis();
+    this->history_uptime_ms_ += now - this->history_last_ms_;
+    this->history_last_ms_ = now;
+    return static_cast<uint32_t>(this->history_uptime_ms_ / 1000);
   }
 
+  void GplugkComponent::handle_history_request(AsyncWebServerRequest *request)
+  {
+    // Without a sensor parameter: list the channels and their fill level
+    if (!request->hasParam("sensor"))
+    {
+      struct ChannelInfo
+      {
+        size_t samples, bytes, capacity;
+        uint32_t first, last;
+      } info[HISTORY_CHANNEL_COUNT];
+      uint32_t now;
+      {
+        LockGuard guard(this->history_lock_);
+        now = this->history_uptime_();
+        for (size_t i = 0; i < HISTORY_CHANNEL_COUNT; i++)
+        {
+          const TimeSeriesRing &ring = this->history_[i];
+          bool empty = ring.size() == 0;
+          info[i] = {ring.size(), ring.bytes_used(), ring.capacity(), empty ? 0 : ring.first_time(),
+                     empty ? 0 : ring.last_time()};
+        }
+      }
+      // now is the current time on the same clock, to map samples to wall-clock time
+      auto *stream = request->beginResponseStream("text/csv");
+      stream->print("sensor,samples,bytes,capacity,first,last,now\n");
+      for (size_t i = 0; i < HISTORY_CHANNEL_COUNT; i++)
+        stream->printf("%s,%u,%u,%u,%u,%u,%u\n", HISTORY_CHANNEL_NAMES[i], (unsigned)info[i].samples,
+                       (unsigned)info[i].bytes, (unsigned)info[i].capacity, info[i].first, info[i].last, now);
+      request->send(stream);
+      return;
+    }
+
+    size_t channel = HISTORY_CHANNEL_COUNT;
+    std::string name = request->getParam("sensor")->value().c_str();
+    for (size_t i = 0; i < HISTORY_CHANNEL_COUNT; i++)
+    {
+      if (name == HISTORY_CHANNEL_NAMES[i])
+        channel = i;
+    }
+    if (channel == HISTORY_CHANNEL_COUNT)
+    {
+      request->send(404, "text/plain", "Unknown sensor");
+      return;
+    }
+    // Serve a copy, so loop() is only held up for the copy and not for the response
+    TimeSeriesRing ring;
+    {
+      LockGuard guard(this->history_lock_);
+      ring = this->history_[channel];
+    }
+
+    uint32_t from = 0;
+    uint32_t to = UINT32_MAX;
+    if (request->hasParam("from"))
+      from = strtoul(request->getParam("from")->value().c_str(), nullptr, 10);
+    if (request->hasParam("to"))
+      to = strtoul(request->getParam("to")->value().c_str(), nullptr, 10);
+    bool binary = request->hasParam("format") && strcmp(request->getParam("format")->value().c_str(), "bin") == 0;
+
+    if (binary)
+    {
+      std::vector<uint8_t> out = encode_series(ring, from, to);
+      request->send(request->beginResponse(200, "application/octet-stream", out.data(), out.size()));
+      return;
+    }
+
+    auto *stream = request->beginResponseStream("text/csv");
+    stream->print("time,value\n");
+    ring.for_each([&](uint32_t time, int64_t value) {
+      if (time >= from && time <= to)
+        stream->printf("%u,%lld\n", time, (long long)value);
+    });
+    request->send(stream);
+  }
+
+#endif
+
+#ifdef USE_GPLUGK_ENERGY_LOG
+  void GplugkComponent::record_energy_(const MeterData &data)
+  {
+    if (!this->energy_log_ready_ || !data.has(MeterField::timestamp))
+      return;
+
+    // One snapshot per interval, from the first frame in it that carries all logged counters
+    uint32_t slot = data.time / this->energy_log_interval_;
+    if (slot <= this->energy_last_slot_)
+      return;
+    int64_t values[ENERGY_LOG_CHANNEL_COUNT];
+    for (size_t i = 0; i < ENERGY_LOG_CHANNEL_COUNT; i++)
+    {
+      if (!data.has(ENERGY_LOG_FIELDS[i]))
+        return;
+      values[i] = data.raw[ENERGY_LOG_FIELDS[i]];
+    }
+    LockGuard guard(this->energy_lock_);
+    this->energy_log_.append(data.time, values);
+    this->energy_last_slot_ = slot;
+    ESP_LOGD(TAG, "Energy log: snapshot at %s", data.timestamp);
+
+    // Written right away: programming a page in several parts costs no erase cycles,
+    // while a snapshot held in RAM is lost on a power cut
+    if (!this->energy_log_.flush(true))
+      ESP_LOGW(TAG, "Energy log: write failed");
+  }
+
+  void GplugkComponent::handle_energy_request(AsyncWebServerRequest *request)
+  {
+    // Counter snapshots; step thins them out, e.g. step=86400 for the first one of each day
+    uint32_t from = 0;
+    uint32_t to = UINT32_MAX;
+    uint32_t step = this->energy_log_interval_;
+    if (request->hasParam("from"))
+      from = strtoul(request->getParam("from")->value().c_str(), nullptr, 10);
+    if (request->hasParam("to"))
+      to = strtoul(request->getParam("to")->value().c_str(), nullptr, 10);
+    if (request->hasParam("step"))
+      step = std::max<uint32_t>(1, strtoul(request->getParam("step")->value().c_str(), nullptr, 10));
+
+    auto *stream = request->beginResponseStream("text/csv");
+    stream->print("time");
+    for (const char *name : ENERGY_LOG_CHANNEL_NAMES)
+      stream->printf(",%s", name);
+    stream->print("\n");
+
+    // Only the state that loop() changes is taken under the lock; flash is read without it
+    EnergyLog::View view;
+    {
+      LockGuard guard(this->energy_lock_);
+      view = this->energy_log_.view();
+    }
+    uint32_t last_bucket = UINT32_MAX;
+    size_t rows = 0;
+    uint32_t next_from = 0;
+    this->energy_log_.for_each(
+        view,
+        [&](uint32_t time, const int64_t *values) {
+          if (time > to)
+            return false;
+          if (time < from || time / step == last_bucket)
+            return true;
+          if (rows++ == ENERGY_LOG_MAX_ROWS)
+          {
+            next_from = time;
+            return false;
+          }
+          last_bucket = time / step;
+          stream->printf("%u", time);
+          for (size_t i = 0; i < ENERGY_LOG_CHANNEL_COUNT; i++)
+            stream->printf(",%lld", (long long)values[i]);
+          stream->print("\n");
+          return true;
+        },
+        from);
+    // More rows than fit in one response: the client continues with from=<X-Next-From>
+    if (next_from != 0)
+    {
+      char header[11];
+      snprintf(header, sizeof(header), "%u", next_from);
+      stream->addHeader("X-Next-From", header);
+    }
+    request->send(stream);
+  }
+#endif
+
+#ifdef USE_GPLUGK_WEB
+  bool RequestHandler::canHandle(AsyncWebServerRequest *request) const
+  {
+    return request->method() == HTTP_GET && request->url() == this->url_;
+  }
+
+  void RequestHandler::handleRequest(AsyncWebServerRequest *request) { (this->parent_->*this->method_)(request); }
+#endif
+
 } // namespace esphome::gplugk
@@ -2,6 +2,7 @@
 
 #include "esphome/core/component.h"
 #include "esphome/core/defines.h"
+#include "esphome/core/helpers.h"
 #include "esphome/core/log.h"
 #ifdef USE_SENSOR
 #include "esphome/components/sensor/sensor.h"
@@ -9,13 +10,30 @@
 #ifdef USE_TEXT_SENSOR
 #include "esphome/components/text_sensor/text_sensor.h"
 #endif
+#ifdef USE_BINARY_SENSOR
+#include "esphome/components/binary_sensor/binary_sensor.h"
+#endif
 #include "esphome/components/uart/uart.h"
+#ifdef USE_GPLUGK_RUNTIME_KEY
+#include "esphome/components/api/custom_api_device.h"
+#include "esphome/core/preferences.h"
+#endif
+#ifdef USE_GPLUGK_WEB
+#include "esphome/components/web_server_base/web_server_base.h"
+#endif
+
+#include "mbedtls/esp_config.h"
+#include "mbedtls/gcm.h"
 
 #include "hdlc.h"
 #include "dlms.h"
 #include "obis.h"
+#include "timeseries.h"
+#include "energylog.h"
+#include "bytesource.h"
 
 #include <array>
+#include <cstring>
 #include <vector>
 
 namespace esphome::gplugk
@@ -29,100 +47,395 @@ namespace esphome::gplugk
 #define GPLUGK_TEXT_SENSOR_LIST(F, SEP)
 #endif
 
+#ifndef GPLUGK_BINARY_SENSOR_LIST
+#define GPLUGK_BINARY_SENSOR_LIST(F, SEP)
+#endif
+
+#ifndef GPLUGK_DIAGNOSTIC_SENSOR_LIST
+#define GPLUGK_DIAGNOSTIC_SENSOR_LIST(F, SEP)
+#endif
+
+#ifndef GPLUGK_HISTORY_LIST
+#define GPLUGK_HISTORY_LIST(F, SEP)
+#endif
+
+#ifndef GPLUGK_ENERGY_LOG_LIST
+#define GPLUGK_ENERGY_LOG_LIST(F, SEP)
+#endif
+
+  // Index of each decoded value in MeterData
+  struct MeterField
+  {
+    enum : uint8_t
+    {
+#define GPLUGK_FIELD_INDEX(name, obis, quantity) name,
+      GPLUGK_METER_FIELDS(GPLUGK_FIELD_INDEX)
+      OBIS_COUNT,
+      // Computed from the decoded values, see GplugkComponent::derive_()
+      net_power = OBIS_COUNT,
+      apparent_power,
+      apparent_power_l1,
+      apparent_power_l2,
+      apparent_power_l3,
+      current_imbalance,
+      reactive_ratio,
+      NUMERIC_COUNT,
+      // Text values
+      timestamp = NUMERIC_COUNT,
+      meter_name,
+      // Binary values
+      grid_export,
+      FIELD_COUNT,
+    };
+  };
+
+  // Last known meter state. Push lists may carry only a subset of the OBIS codes, so
+  // values persist across frames and `present` marks those carried by the latest frame.
+#define GPLUGK_FIELD_QUANTITY(name, obis, quantity) quantity,
+  static constexpr Quantity FIELD_QUANTITIES[MeterField::OBIS_COUNT] = {GPLUGK_METER_FIELDS(GPLUGK_FIELD_QUANTITY)};
+
   struct MeterData
   {
-    // Energy totals
-    float active_energy_plus = 0.0f;
-    float active_energy_minus = 0.0f;
-    float reactive_energy_plus = 0.0f;
-    float reactive_energy_minus = 0.0f;
-
-    // Meter ID
-    float meter_id = 0.0f;
-
-    // Total power
-    float active_power_plus = 0.0f;
-    float active_power_minus = 0.0f;
-    float reactive_power_plus = 0.0f;
-    float reactive_power_minus = 0.0f;
-
-    // Voltage
-    float voltage_l1 = 0.0f;
-    float voltage_l2 = 0.0f;
-    float voltage_l3 = 0.0f;
-
-    // Current
-    float current_l1 = 0.0f;
-    float current_l2 = 0.0f;
-    float current_l3 = 0.0f;
-
-    // Active power per phase
-    float active_power_l1 = 0.0f;
-    float active_power_l2 = 0.0f;
-    float active_power_l3 = 0.0f;
-    float active_power_minus_l1 = 0.0f;
-    float active_power_minus_l2 = 0.0f;
-    float active_power_minus_l3 = 0.0f;
-
-    // Power factor
-    float power_factor = 0.0f;
-    float power_factor_l1 = 0.0f;
-    float power_factor_l2 = 0.0f;
-    float power_factor_l3 = 0.0f;
-
-    // Active energy per phase
-    float active_energy_plus_l1 = 0.0f;
-    float active_energy_plus_l2 = 0.0f;
-    float active_energy_plus_l3 = 0.0f;
-    float active_energy_minus_l1 = 0.0f;
-    float active_energy_minus_l2 = 0.0f;
-    float active_energy_minus_l3 = 0.0f;
+    uint32_t raw[MeterField::OBIS_COUNT]{};    // as sent by the meter
+    float values[MeterField::NUMERIC_COUNT]{}; // scaled for publishing, then derived values
 
     // Text sensors
     char timestamp[27]{};
     char meter_name[20]{};
+
+    // Binary sensors
+    bool grid_export = false;
+
+    uint32_t time = 0; // meter clock as seconds since 1970, valid with timestamp
+    uint64_t present = 0;
+
+    bool has(uint8_t field) const { return (this->present >> field) & 1; }
+    void set(uint8_t field, uint32_t raw, float value)
+    {
+      this->raw[field] = raw;
+      this->values[field] = value;
+      this->mark(field);
+    }
+    void mark(uint8_t field) { this->present |= uint64_t(1) << field; }
   };
 
-  class GplugkComponent : public Component, public uart::UARTDevice
+#define GPLUGK_COUNT_DIAGNOSTIC(s) +1
+  static constexpr uint8_t DIAGNOSTIC_SENSOR_COUNT = 0 GPLUGK_DIAGNOSTIC_SENSOR_LIST(GPLUGK_COUNT_DIAGNOSTIC, );
+
+#ifdef USE_GPLUGK_HISTORY
+#define GPLUGK_HISTORY_NAME(s) #s,
+  static constexpr const char *HISTORY_CHANNEL_NAMES[] = {GPLUGK_HISTORY_LIST(GPLUGK_HISTORY_NAME, )};
+  static constexpr size_t HISTORY_CHANNEL_COUNT = sizeof(HISTORY_CHANNEL_NAMES) / sizeof(HISTORY_CHANNEL_NAMES[0]);
+  static constexpr const char *HISTORY_URL = "/gplugk/history";
+#endif
+
+#ifdef USE_GPLUGK_ENERGY_LOG
+#define GPLUGK_ENERGY_LOG_FIELD(s) MeterField::s,
+#define GPLUGK_ENERGY_LOG_NAME(s) #s,
+#define GPLUGK_ENERGY_LOG_LAYOUT(s) #s ","
+  static constexpr uint8_t ENERGY_LOG_FIELDS[] = {GPLUGK_ENERGY_LOG_LIST(GPLUGK_ENERGY_LOG_FIELD, )};
+  static constexpr const char *ENERGY_LOG_CHANNEL_NAMES[] = {GPLUGK_ENERGY_LOG_LIST(GPLUGK_ENERGY_LOG_NAME, )};
+  static constexpr size_t ENERGY_LOG_CHANNEL_COUNT = sizeof(ENERGY_LOG_FIELDS);
+  // Stored in every sector, so records are never read back with another channel list
+  static constexpr const char *ENERGY_LOG_LAYOUT = "" GPLUGK_ENERGY_LOG_LIST(GPLUGK_ENERGY_LOG_LAYOUT, );
+  static constexpr const char *ENERGY_LOG_URL = "/gplugk/energy";
+  // A response is built in RAM, so a year of hourly rows has to be fetched in parts
+  static constexpr size_t ENERGY_LOG_MAX_ROWS = 250;
+#endif
+
+#ifdef USE_GPLUGK_WEB
+  class GplugkComponent;
+
+  // Forwards GET requests for one URL to a component method
+  class RequestHandler : public AsyncWebHandler
+  {
+  public:
+    using Method = void (GplugkComponent::*)(AsyncWebServerRequest *);
+
+    RequestHandler(GplugkComponent *parent, const char *url, Method method)
+        : parent_(parent), url_(url), method_(method) {}
+
+    bool canHandle(AsyncWebServerRequest *request) const override;
+    void handleRequest(AsyncWebServerRequest *request) override;
+
+  protected:
+    GplugkComponent *parent_;
+    const char *url_;
+    Method method_;
+  };
+#endif
+
+  // Compiled-in keys plus one slot for a key set at runtime
+  static constexpr uint8_t MAX_DECRYPTION_KEYS = 4;
+
+  class GplugkComponent : public Component,
+#ifdef USE_GPLUGK_RUNTIME_KEY
+                          public api::CustomAPIDevice,
+#endif
+                          public uart::UARTDevice
   {
   public:
     GplugkComponent() = default;
 
+    void setup() override;
     void dump_config() override;
     void loop() override;
+#ifdef USE_GPLUGK_WEB
+    // The HTTP endpoints are registered on the web server, which needs the network stack
+    float get_setup_priority() const override { return setup_priority::WIFI - 1.0f; }
 
-    void set_decryption_key(const std::array<uint8_t, 16> &key) { this->decryption_key_ = key; }
+    void set_web_server_base(web_server_base::WebServerBase *base) { this->web_server_base_ = base; }
+#endif
+#ifdef USE_GPLUGK_HISTORY
+    void set_history_buffer_size(size_t size) { this->history_buffer_size_ = size; }
+    void handle_history_request(AsyncWebServerRequest *request);
+#endif
+#ifdef USE_GPLUGK_ENERGY_LOG
+    void set_energy_log_partition(const char *label) { this->energy_log_partition_ = label; }
+    void set_energy_log_interval(uint32_t interval_s) { this->energy_log_interval_ = interval_s; }
+    void handle_energy_request(AsyncWebServerRequest *request);
+#endif
 
-    void publish_sensors(MeterData &data)
+    void add_decryption_key(const std::array<uint8_t, 16> &key)
     {
-#define GPLUGK_PUBLISH_SENSOR(s)    \
-  if (this->s##_sensor_ != nullptr) \
-    s##_sensor_->publish_state(data.s);
-      GPLUGK_SENSOR_LIST(GPLUGK_PUBLISH_SENSOR, )
-
-#define GPLUGK_PUBLISH_TEXT_SENSOR(s)    \
-  if (this->s##_text_sensor_ != nullptr) \
-    s##_text_sensor_->publish_state(data.s);
-      GPLUGK_TEXT_SENSOR_LIST(GPLUGK_PUBLISH_TEXT_SENSOR, )
+      if (this->compiled_keys_ < MAX_DECRYPTION_KEYS - 1)
+        this->keyring_[this->compiled_keys_++].key = key;
+      this->key_count_ = this->compiled_keys_;
     }
+    void set_streaming(bool streaming) { this->streaming_ = streaming; }
+    void set_meter_profile(MeterProfile profile) { this->meter_profile_ = profile; }
+    // Overrides the profile scaler of one field
+    void set_scale(uint8_t field, float scale) { this->scale_overrides_[field] = scale; }
+
+    void set_loop_budget(uint32_t budget_us) { this->loop_budget_us_ = budget_us; }
+    // Reads from another source than the UART, e.g. a simulated meter
+    void set_byte_source(ByteSource *source) { this->source_ = source; }
 
     GPLUGK_SENSOR_LIST(SUB_SENSOR, )
+    GPLUGK_DIAGNOSTIC_SENSOR_LIST(SUB_SENSOR, )
     GPLUGK_TEXT_SENSOR_LIST(SUB_TEXT_SENSOR, )
+    GPLUGK_BINARY_SENSOR_LIST(SUB_BINARY_SENSOR, )
 
   protected:
+    // Decryption progress of the frame currently being received
+    struct StreamState
+    {
+      enum State : uint8_t
+      {
+        WAIT_HEADER, // not enough bytes to parse the headers yet
+        DECRYPTING,  // GCM started, ciphertext is decrypted as it arrives
+        DECLINED,    // headers not streamable, the frame is handled after the read timeout
+        NO_KEY,      // no key decrypts the first block, the frame is dropped after the read timeout
+      };
+      State state = WAIT_HEADER;
+      uint16_t frame_size = 0;    // opening flag to closing flag
+      uint16_t header_offset = 0; // DLMS header extension before the frame counter
+      uint16_t payload_start = 0; // ciphertext offsets in receive_buffer_
+      uint16_t payload_end = 0;
+      uint16_t decrypted = 0;
+    };
+
+    // Frame processing, split into steps so loop() can stop once its time budget is spent
+    struct FrameJob
+    {
+      enum Stage : uint8_t
+      {
+        IDLE,     // receiving
+        VALIDATE, // HDLC and DLMS headers
+        DECRYPT,  // skipped when the payload was decrypted while streaming
+        DECODE,   // COSEM into meter_
+        PUBLISH,     // one sensor per step
+        HISTORY,     // append to the history rings
+        ENERGY_LOG,  // snapshot into the energy log
+        ERASE,       // energy log sector to wrap into, when the current one is nearly full
+        DIAGNOSTICS, // one diagnostic sensor per step
+      };
+      Stage stage = IDLE;
+      uint16_t message_length = 0;
+      uint16_t header_offset = 0;
+      uint8_t *plaintext = nullptr;   // data-notification APDU
+      uint8_t next_field = 0;         // MeterField to publish next
+      uint8_t next_diagnostic = 0;    // index in GPLUGK_DIAGNOSTIC_SENSOR_LIST
+      uint16_t iterations = 0;        // loop() calls spent on this frame
+      uint32_t slowest_step_time = 0; // us
+      uint8_t slowest_stage = IDLE;
+    };
+
+    // Positions of the decoded values in a fully parsed frame. Meters that alternate
+    // push lists send a few different shapes, so several are kept.
+    static constexpr uint8_t MAX_FRAME_LAYOUTS = 4;
+    struct FrameLayout
+    {
+      static constexpr uint8_t HEADER_SIZE = 9; // OCTET_STRING tag + length + OBIS code(6) + data type
+      static constexpr uint8_t TYPE_INDEX = 8;
+
+      struct Entry
+      {
+        uint16_t offset; // of the OBIS code OCTET_STRING tag
+        uint8_t header[HEADER_SIZE];
+        uint8_t string_length; // OCTET_STRING values only
+        uint8_t field;         // MeterField index
+
+        static Entry from(const uint8_t *plaintext, uint16_t offset, uint8_t field);
+      };
+
+      bool valid = false;
+      uint16_t message_length = 0;
+      uint8_t prefix[4]; // STRUCTURE tag + count, VISIBLE_STRING tag + meter name length
+      std::vector<Entry> entries;
+
+      bool matches(const uint8_t *plaintext, uint16_t length) const
+      {
+        return this->valid && length == this->message_length &&
+               memcmp(plaintext, this->prefix, sizeof(this->prefix)) == 0;
+      }
+    };
+
+    bool receive_();
+    void run_stages_(uint32_t start);
+    void step_();
+    void end_frame_();
+    bool validate_frame_();
+    void stream_decrypt_();
+    bool start_stream_();
     bool parse_hdlc_(std::vector<uint8_t> &dlms_data);
     bool parse_dlms_(const std::vector<uint8_t> &dlms_data, uint16_t &message_length, uint8_t &systitle_length,
                      uint16_t &header_offset);
-    bool decrypt_(std::vector<uint8_t> &dlms_data, uint16_t message_length, uint8_t systitle_length,
-                  uint16_t header_offset);
-    void decode_cosem_(uint8_t *plaintext, uint16_t message_length);
+    void start_decrypt_(uint8_t key, const uint8_t *dlms, uint16_t header_offset);
+    bool decrypt_first_block_(const uint8_t *dlms, uint16_t header_offset, const uint8_t *ciphertext,
+                              uint8_t *plaintext);
+    bool expand_key_(uint8_t key);
+#ifdef USE_GPLUGK_RUNTIME_KEY
+    void on_set_decryption_key_(std::string key);
+    void keyring_changed_();
+#endif
+    void publish_diagnostics_();
+    bool publish_diagnostic_(uint8_t index);
+    bool decrypt_(std::vector<uint8_t> &dlms_data, uint16_t message_length, uint16_t header_offset);
+    bool check_plaintext_(const uint8_t *plaintext, uint16_t message_length);
+    bool decode_cosem_(uint8_t *plaintext, uint16_t message_length);
+    bool decode_cached_(const uint8_t *plaintext, uint16_t message_length, MeterData &data);
+    bool decode_layout_(const FrameLayout &layout, const uint8_t *plaintext, MeterData &data);
+    bool parse_cosem_(const uint8_t *plaintext, uint16_t message_length, MeterData &data);
+    void store_value_(MeterData &data, uint8_t field, uint32_t raw);
+    void derive_(MeterData &data);
+
+    // Publishes one field if it has a sensor and the frame carried it
+    bool publish_field_(const MeterData &data, uint8_t field)
+    {
+      if (!data.has(field))
+        return false;
+      switch (field)
+      {
+#define GPLUGK_PUBLISH_SENSOR(s)                                  \
+  case MeterField::s:                                             \
+    if (this->s##_sensor_ == nullptr)                             \
+      return false;                                               \
+    this->s##_sensor_->publish_state(data.values[MeterField::s]); \
+    return true;
+        GPLUGK_SENSOR_LIST(GPLUGK_PUBLISH_SENSOR, )
+#define GPLUGK_PUBLISH_TEXT_SENSOR(s)              \
+  case MeterField::s:                              \
+    if (this->s##_text_sensor_ == nullptr)         \
+      return false;                                \
+    this->s##_text_sensor_->publish_state(data.s); \
+    return true;
+        GPLUGK_TEXT_SENSOR_LIST(GPLUGK_PUBLISH_TEXT_SENSOR, )
+#define GPLUGK_PUBLISH_BINARY_SENSOR(s)              \
+  case MeterField::s:                                \
+    if (this->s##_binary_sensor_ == nullptr)         \
+      return false;                                  \
+    this->s##_binary_sensor_->publish_state(data.s); \
+    return true;
+        GPLUGK_BINARY_SENSOR_LIST(GPLUGK_PUBLISH_BINARY_SENSOR, )
+      default:
+        return false;
+      }
+    }
+#ifdef USE_GPLUGK_HISTORY
+    void record_history_(const MeterData &data);
+    uint32_t history_uptime_();
+#endif
+#ifdef USE_GPLUGK_ENERGY_LOG
+    void record_energy_(const MeterData &data);
+#endif
 
     std::vector<uint8_t> receive_buffer_;
     std::vector<uint8_t> dlms_data_;
-    uint32_t last_read_ = 0;
     uint32_t read_timeout_ = 1000;
+    UARTPollSource poll_source_{this, this->read_timeout_};
+    ByteSource *source_ = &this->poll_source_;
+#ifdef USE_GPLUGK_UART_EVENTS
+    UARTEventSource event_source_;
+    uint32_t reported_overflows_ = 0;
+#endif
+
+    // AES key with its GCM context, expanded once
+    struct DecryptionKey
+    {
+      std::array<uint8_t, 16> key;
+      mbedtls_gcm_context ctx;
+    };
+    std::array<DecryptionKey, MAX_DECRYPTION_KEYS> keyring_;
+    uint8_t key_count_ = 0;
+    uint8_t compiled_keys_ = 0;
+    uint8_t active_key_ = 0; // last key that decrypted a frame
+    uint32_t key_fallbacks_ = 0;
+    uint32_t key_switches_ = 0;
 
-    std::array<uint8_t, 16> decryption_key_;
+    FrameJob job_;
+    uint32_t loop_budget_us_ = 5000;
+    uint32_t budget_overruns_ = 0;
+    uint32_t frame_iterations_ = 0;  // loop() calls the last frame took
+    uint32_t slowest_step_time_ = 0; // us, longest step of the last frame
+    uint32_t slowest_stage_ = 0;     // FrameJob::Stage of that step
+#ifdef USE_GPLUGK_RUNTIME_KEY
+    struct RuntimeKey
+    {
+      uint8_t key[16];
+      bool set;
+    };
+    ESPPreferenceObject runtime_key_pref_;
+#endif
+
+    MeterProfile meter_profile_ = METER_PROFILE_RAW;
+    std::array<float, MeterField::OBIS_COUNT> scale_overrides_{}; // 0 = use profile
+    std::array<float, MeterField::OBIS_COUNT> scales_{};
+    float power_scale_ = 1.0f;          // W in the profile's power unit, ignoring scale overrides
+    float apparent_power_scale_ = 1.0f; // V * A in the profile's power unit
+
+    bool streaming_ = true;
+    StreamState stream_;
+    std::vector<uint8_t> plaintext_;
+    std::array<FrameLayout, MAX_FRAME_LAYOUTS> layouts_;
+    uint8_t next_layout_ = 0; // replaced when no layout has the shape of a new frame
+    MeterData meter_;
+
+#ifdef USE_GPLUGK_WEB
+    web_server_base::WebServerBase *web_server_base_{nullptr};
+#endif
+#ifdef USE_GPLUGK_HISTORY
+    // Written by loop(), read by the web server task
+    Mutex history_lock_;
+    std::array<TimeSeriesRing, HISTORY_CHANNEL_COUNT> history_;
+    size_t history_buffer_size_ = 16384;
+    uint64_t history_uptime_ms_ = 0;
+    uint32_t history_last_ms_ = 0;
+#endif
+#ifdef USE_GPLUGK_ENERGY_LOG
+#ifdef USE_ESP32
+    PartitionStorage energy_storage_;
+#else
+    FileStorage energy_storage_;
+#endif
+    // Written by loop(), read by the web server task
+    Mutex energy_lock_;
+    EnergyLog energy_log_;
+    bool energy_log_ready_ = false;
+    const char *energy_log_partition_ = "gplugk";
+    uint32_t energy_log_interval_ = 3600; // seconds
+    uint32_t energy_last_slot_ = 0;       // interval of the last snapshot
+#endif
   };
 
 } // namespace esphome::gplugk
@@ -68,4 +68,17 @@ inline bool crc16_x25_check(const uint8_t *data, size_t len, const uint8_t *crc_
   return computed == received;
 }
 
+// Validates opening flag, frame format and HCS of a frame whose first HDLC_INFO_OFFSET
+// bytes are available. Returns the total frame size including both flags, 0 if invalid.
+inline uint16_t hdlc_frame_size(const uint8_t *frame) {
+  if (frame[0] != HDLC_FLAG)
+    return 0;
+  uint16_t frame_format = (frame[1] << 8) | frame[2];
+  if (((frame_format >> 12) & 0x0F) != HDLC_FORMAT_TYPE)
+    return 0;
+  if (!crc16_x25_check(&frame[1], HDLC_HEADER_SIZE, &frame[HDLC_HCS_OFFSET]))
+    return 0;
+  return 1 + (frame_format & 0x07FF) + 1;
+}
+
 }  // namespace esphome::gplugk
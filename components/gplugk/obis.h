@@ -69,4 +69,73 @@ static constexpr uint16_t OBIS_ACTIVE_ENERGY_MINUS_L1 = 0x1608;
 static constexpr uint16_t OBIS_ACTIVE_ENERGY_MINUS_L2 = 0x2A08;
 static constexpr uint16_t OBIS_ACTIVE_ENERGY_MINUS_L3 = 0x3E08;
 
+// Physical quantity of an OBIS value, selects its scaler and unit
+enum Quantity : uint8_t {
+  ENERGY,
+  POWER,
+  VOLTAGE,
+  CURRENT,
+  POWER_FACTOR,
+  IDENTIFIER,
+  QUANTITY_COUNT,
+};
+
+// How push-list integers map to published values
+enum MeterProfile : uint8_t {
+  METER_PROFILE_RAW,       // integers as sent by the meter
+  METER_PROFILE_KAMSTRUP,  // Omnipower resolution converted to kWh, kW, V, A
+  METER_PROFILE_COUNT,
+};
+
+// Published value = raw * 10^exponent. The matching units are set by PROFILE_UNITS in
+// __init__.py.
+struct ObisScaler {
+  int8_t exponent;
+};
+
+static constexpr ObisScaler OBIS_SCALERS[METER_PROFILE_COUNT][QUANTITY_COUNT] = {
+    // METER_PROFILE_RAW (values as previously published; current and power factor are in 0.01)
+    {{0}, {0}, {0}, {0}, {0}, {0}},
+    // METER_PROFILE_KAMSTRUP: Wh, W, V, 0.01 A, 0.01 to kWh, kW, V, A, 0-1
+    {{-3}, {-3}, {0}, {-2}, {-2}, {0}},
+};
+
+// Decimal exponent from the push-list integer to the SI unit (Wh, W, V, A, 1), used
+// for values derived from several quantities
+static constexpr int8_t OBIS_SI_EXPONENTS[QUANTITY_COUNT] = {0, 0, 0, -2, -2, 0};
+
+// Numeric values decoded from the push list: MeterData field, OBIS CD, quantity
+#define GPLUGK_METER_FIELDS(F) \
+  F(active_energy_plus, OBIS_ACTIVE_ENERGY_PLUS, ENERGY) \
+  F(active_energy_minus, OBIS_ACTIVE_ENERGY_MINUS, ENERGY) \
+  F(reactive_energy_plus, OBIS_REACTIVE_ENERGY_PLUS, ENERGY) \
+  F(reactive_energy_minus, OBIS_REACTIVE_ENERGY_MINUS, ENERGY) \
+  F(meter_id, OBIS_METER_ID, IDENTIFIER) \
+  F(active_power_plus, OBIS_ACTIVE_POWER_PLUS, POWER) \
+  F(active_power_minus, OBIS_ACTIVE_POWER_MINUS, POWER) \
+  F(reactive_power_plus, OBIS_REACTIVE_POWER_PLUS, POWER) \
+  F(reactive_power_minus, OBIS_REACTIVE_POWER_MINUS, POWER) \
+  F(voltage_l1, OBIS_VOLTAGE_L1, VOLTAGE) \
+  F(voltage_l2, OBIS_VOLTAGE_L2, VOLTAGE) \
+  F(voltage_l3, OBIS_VOLTAGE_L3, VOLTAGE) \
+  F(current_l1, OBIS_CURRENT_L1, CURRENT) \
+  F(current_l2, OBIS_CURRENT_L2, CURRENT) \
+  F(current_l3, OBIS_CURRENT_L3, CURRENT) \
+  F(active_power_l1, OBIS_ACTIVE_POWER_L1, POWER) \
+  F(active_power_l2, OBIS_ACTIVE_POWER_L2, POWER) \
+  F(active_power_l3, OBIS_ACTIVE_POWER_L3, POWER) \
+  F(active_power_minus_l1, OBIS_ACTIVE_POWER_MINUS_L1, POWER) \
+  F(active_power_minus_l2, OBIS_ACTIVE_POWER_MINUS_L2, POWER) \
+  F(active_power_minus_l3, OBIS_ACTIVE_POWER_MINUS_L3, POWER) \
+  F(power_factor, OBIS_POWER_FACTOR, POWER_FACTOR) \
+  F(power_factor_l1, OBIS_POWER_FACTOR_L1, POWER_FACTOR) \
+  F(power_factor_l2, OBIS_POWER_FACTOR_L2, POWER_FACTOR) \
+  F(power_factor_l3, OBIS_POWER_FACTOR_L3, POWER_FACTOR) \
+  F(active_energy_plus_l1, OBIS_ACTIVE_ENERGY_PLUS_L1, ENERGY) \
+  F(active_energy_plus_l2, OBIS_ACTIVE_ENERGY_PLUS_L2, ENERGY) \
+  F(active_energy_plus_l3, OBIS_ACTIVE_ENERGY_PLUS_L3, ENERGY) \
+  F(active_energy_minus_l1, OBIS_ACTIVE_ENERGY_MINUS_L1, ENERGY) \
+  F(active_energy_minus_l2, OBIS_ACTIVE_ENERGY_MINUS_L2, ENERGY) \
+  F(active_energy_minus_l3, OBIS_ACTIVE_ENERGY_MINUS_L3, ENERGY)
+
 }  // namespace esphome::gplugk
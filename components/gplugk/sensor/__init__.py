@@ -2,232 +2,177 @@ import esphome.codegen as cg
 from esphome.components import sensor
 import esphome.config_validation as cv
 from esphome.const import (
+    CONF_ACCURACY_DECIMALS,
     CONF_ID,
+    CONF_UNIT_OF_MEASUREMENT,
+    DEVICE_CLASS_APPARENT_POWER,
     DEVICE_CLASS_CURRENT,
     DEVICE_CLASS_ENERGY,
     DEVICE_CLASS_POWER,
     DEVICE_CLASS_POWER_FACTOR,
     DEVICE_CLASS_VOLTAGE,
+    ENTITY_CATEGORY_DIAGNOSTIC,
     STATE_CLASS_MEASUREMENT,
     STATE_CLASS_TOTAL_INCREASING,
-    UNIT_AMPERE,
-    UNIT_VOLT,
-    UNIT_WATT,
-    UNIT_WATT_HOURS,
 )
+from esphome.core import CORE
 
-from .. import CONF_GPLUGK_ID, GplugkComponent
+from .. import (
+    CONF_GPLUGK_ID,
+    CONF_METER_PROFILE,
+    DERIVED_SENSORS,
+    METER_SENSORS,
+    PROFILE_UNITS,
+    QUANTITY_APPARENT_POWER,
+    QUANTITY_CURRENT,
+    QUANTITY_ENERGY,
+    QUANTITY_IDENTIFIER,
+    QUANTITY_PERCENT,
+    QUANTITY_POWER,
+    QUANTITY_POWER_FACTOR,
+    QUANTITY_RATIO,
+    QUANTITY_VOLTAGE,
+    GplugkComponent,
+    gplugk_ns,
+)
 
 AUTO_LOAD = ["gplugk"]
 
+CONF_SCALE = "scale"
+
+MeterField = gplugk_ns.namespace("MeterField")
+
+
+def validate_scale(value):
+    # 0 stands for "use the profile" in the component, so it cannot be a user value
+    value = cv.float_(value)
+    if value == 0:
+        raise cv.Invalid("scale must not be 0")
+    return value
+
+
+# Unit and accuracy come from the meter profile, see to_code()
+QUANTITY_SCHEMAS = {
+    QUANTITY_ENERGY: sensor.sensor_schema(
+        device_class=DEVICE_CLASS_ENERGY,
+        state_class=STATE_CLASS_TOTAL_INCREASING,
+    ),
+    QUANTITY_POWER: sensor.sensor_schema(
+        device_class=DEVICE_CLASS_POWER,
+        state_class=STATE_CLASS_MEASUREMENT,
+    ),
+    QUANTITY_VOLTAGE: sensor.sensor_schema(
+        device_class=DEVICE_CLASS_VOLTAGE,
+        state_class=STATE_CLASS_MEASUREMENT,
+    ),
+    QUANTITY_CURRENT: sensor.sensor_schema(
+        device_class=DEVICE_CLASS_CURRENT,
+        state_class=STATE_CLASS_MEASUREMENT,
+    ),
+    QUANTITY_POWER_FACTOR: sensor.sensor_schema(
+        device_class=DEVICE_CLASS_POWER_FACTOR,
+        state_class=STATE_CLASS_MEASUREMENT,
+    ),
+    QUANTITY_IDENTIFIER: sensor.sensor_schema(),
+    QUANTITY_APPARENT_POWER: sensor.sensor_schema(
+        device_class=DEVICE_CLASS_APPARENT_POWER,
+        state_class=STATE_CLASS_MEASUREMENT,
+    ),
+    QUANTITY_PERCENT: sensor.sensor_schema(
+        state_class=STATE_CLASS_MEASUREMENT,
+    ),
+    QUANTITY_RATIO: sensor.sensor_schema(
+        state_class=STATE_CLASS_MEASUREMENT,
+    ),
+}
+
+# Component counters rather than meter values
+DIAGNOSTIC_SENSORS = {
+    "key_fallbacks": sensor.sensor_schema(
+        accuracy_decimals=0,
+        state_class=STATE_CLASS_TOTAL_INCREASING,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    "key_switches": sensor.sensor_schema(
+        accuracy_decimals=0,
+        state_class=STATE_CLASS_TOTAL_INCREASING,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    "budget_overruns": sensor.sensor_schema(
+        accuracy_decimals=0,
+        state_class=STATE_CLASS_TOTAL_INCREASING,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    "frame_iterations": sensor.sensor_schema(
+        accuracy_decimals=0,
+        state_class=STATE_CLASS_MEASUREMENT,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    "slowest_step_time": sensor.sensor_schema(
+        unit_of_measurement="µs",
+        accuracy_decimals=0,
+        state_class=STATE_CLASS_MEASUREMENT,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+    "slowest_stage": sensor.sensor_schema(
+        accuracy_decimals=0,
+        entity_category=ENTITY_CATEGORY_DIAGNOSTIC,
+    ),
+}
+
 CONFIG_SCHEMA = cv.Schema(
     {
         cv.GenerateID(CONF_GPLUGK_ID): cv.use_id(GplugkComponent),
-        # Energy totals
-        cv.Optional("active_energy_plus"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_WATT_HOURS,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_ENERGY,
-            state_class=STATE_CLASS_TOTAL_INCREASING,
-        ),
-        cv.Optional("active_energy_minus"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_WATT_HOURS,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_ENERGY,
-            state_class=STATE_CLASS_TOTAL_INCREASING,
-        ),
-        cv.Optional("reactive_energy_plus"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_WATT_HOURS,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_ENERGY,
-            state_class=STATE_CLASS_TOTAL_INCREASING,
-        ),
-        cv.Optional("reactive_energy_minus"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_WATT_HOURS,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_ENERGY,
-            state_class=STATE_CLASS_TOTAL_INCREASING,
-        ),
-        # Meter ID
-        cv.Optional("meter_id"): sensor.sensor_schema(
-            accuracy_decimals=0,
-        ),
-        # Total power
-        cv.Optional("active_power_plus"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_WATT,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_POWER,
-            state_class=STATE_CLASS_MEASUREMENT,
-        ),
-        cv.Optional("active_power_minus"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_WATT,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_POWER,
-            state_class=STATE_CLASS_MEASUREMENT,
-        ),
-        cv.Optional("reactive_power_plus"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_WATT,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_POWER,
-            state_class=STATE_CLASS_MEASUREMENT,
-        ),
-        cv.Optional("reactive_power_minus"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_WATT,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_POWER,
-            state_class=STATE_CLASS_MEASUREMENT,
-        ),
-        # Voltage
-        cv.Optional("voltage_l1"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_VOLT,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_VOLTAGE,
-            state_class=STATE_CLASS_MEASUREMENT,
-        ),
-        cv.Optional("voltage_l2"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_VOLT,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_VOLTAGE,
-            state_class=STATE_CLASS_MEASUREMENT,
-        ),
-        cv.Optional("voltage_l3"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_VOLT,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_VOLTAGE,
-            state_class=STATE_CLASS_MEASUREMENT,
-        ),
-        # Current
-        cv.Optional("current_l1"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_AMPERE,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_CURRENT,
-            state_class=STATE_CLASS_MEASUREMENT,
-        ),
-        cv.Optional("current_l2"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_AMPERE,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_CURRENT,
-            state_class=STATE_CLASS_MEASUREMENT,
-        ),
-        cv.Optional("current_l3"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_AMPERE,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_CURRENT,
-            state_class=STATE_CLASS_MEASUREMENT,
-        ),
-        # Active power per phase
-        cv.Optional("active_power_l1"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_WATT,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_POWER,
-            state_class=STATE_CLASS_MEASUREMENT,
-        ),
-        cv.Optional("active_power_l2"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_WATT,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_POWER,
-            state_class=STATE_CLASS_MEASUREMENT,
-        ),
-        cv.Optional("active_power_l3"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_WATT,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_POWER,
-            state_class=STATE_CLASS_MEASUREMENT,
-        ),
-        cv.Optional("active_power_minus_l1"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_WATT,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_POWER,
-            state_class=STATE_CLASS_MEASUREMENT,
-        ),
-        cv.Optional("active_power_minus_l2"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_WATT,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_POWER,
-            state_class=STATE_CLASS_MEASUREMENT,
-        ),
-        cv.Optional("active_power_minus_l3"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_WATT,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_POWER,
-            state_class=STATE_CLASS_MEASUREMENT,
-        ),
-        # Power factor
-        cv.Optional("power_factor"): sensor.sensor_schema(
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_POWER_FACTOR,
-            state_class=STATE_CLASS_MEASUREMENT,
-        ),
-        cv.Optional("power_factor_l1"): sensor.sensor_schema(
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_POWER_FACTOR,
-            state_class=STATE_CLASS_MEASUREMENT,
-        ),
-        cv.Optional("power_factor_l2"): sensor.sensor_schema(
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_POWER_FACTOR,
-            state_class=STATE_CLASS_MEASUREMENT,
-        ),
-        cv.Optional("power_factor_l3"): sensor.sensor_schema(
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_POWER_FACTOR,
-            state_class=STATE_CLASS_MEASUREMENT,
-        ),
-        # Active energy per phase
-        cv.Optional("active_energy_plus_l1"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_WATT_HOURS,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_ENERGY,
-            state_class=STATE_CLASS_TOTAL_INCREASING,
-        ),
-        cv.Optional("active_energy_plus_l2"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_WATT_HOURS,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_ENERGY,
-            state_class=STATE_CLASS_TOTAL_INCREASING,
-        ),
-        cv.Optional("active_energy_plus_l3"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_WATT_HOURS,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_ENERGY,
-            state_class=STATE_CLASS_TOTAL_INCREASING,
-        ),
-        cv.Optional("active_energy_minus_l1"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_WATT_HOURS,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_ENERGY,
-            state_class=STATE_CLASS_TOTAL_INCREASING,
-        ),
-        cv.Optional("active_energy_minus_l2"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_WATT_HOURS,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_ENERGY,
-            state_class=STATE_CLASS_TOTAL_INCREASING,
-        ),
-        cv.Optional("active_energy_minus_l3"): sensor.sensor_schema(
-            unit_of_measurement=UNIT_WATT_HOURS,
-            accuracy_decimals=0,
-            device_class=DEVICE_CLASS_ENERGY,
-            state_class=STATE_CLASS_TOTAL_INCREASING,
-        ),
+        **{
+            cv.Optional(key): QUANTITY_SCHEMAS[quantity].extend(
+                {
+                    # Replaces the profile scaler, e.g. instead of a multiply filter
+                    cv.Optional(CONF_SCALE): validate_scale,
+                }
+            )
+            for key, quantity in METER_SENSORS.items()
+        },
+        **{
+            cv.Optional(key): QUANTITY_SCHEMAS[quantity]
+            for key, quantity in DERIVED_SENSORS.items()
+        },
+        **{cv.Optional(key): schema for key, schema in DIAGNOSTIC_SENSORS.items()},
     }
 ).extend(cv.COMPONENT_SCHEMA)
 
 
 async def to_code(config):
     hub = await cg.get_variable(config[CONF_GPLUGK_ID])
+    profile_units = PROFILE_UNITS[str(CORE.config["gplugk"][CONF_METER_PROFILE])]
 
     sensors = []
+    diagnostics = []
     for key, conf in config.items():
         if not isinstance(conf, dict):
             continue
         id = conf[CONF_ID]
-        if id and id.type == sensor.Sensor:
+        if id and id.type == sensor.Sensor and key in DIAGNOSTIC_SENSORS:
+            sens = await sensor.new_sensor(conf)
+            cg.add(getattr(hub, f"set_{key}_sensor")(sens))
+            diagnostics.append(f"F({key})")
+        elif id and id.type == sensor.Sensor:
+            quantity = METER_SENSORS.get(key) or DERIVED_SENSORS[key]
+            unit, accuracy = profile_units[quantity]
+            if unit is not None:
+                conf.setdefault(CONF_UNIT_OF_MEASUREMENT, unit)
+            conf.setdefault(CONF_ACCURACY_DECIMALS, accuracy)
             sens = await sensor.new_sensor(conf)
             cg.add(getattr(hub, f"set_{key}_sensor")(sens))
+            if CONF_SCALE in conf:
+                cg.add(hub.set_scale(getattr(MeterField, key), conf[CONF_SCALE]))
             sensors.append(f"F({key})")
 
     if sensors:
         cg.add_define(
             "GPLUGK_SENSOR_LIST(F, sep)", cg.RawExpression(" sep ".join(sensors))
         )
+    if diagnostics:
+        cg.add_define(
+            "GPLUGK_DIAGNOSTIC_SENSOR_LIST(F, sep)",
+            cg.RawExpression(" sep ".join(diagnostics)),
+        )
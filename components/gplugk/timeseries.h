@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace esphome::gplugk {
+
+// Zig-zag mapping: small negative deltas become small unsigned values
+inline uint64_t zigzag_encode(int64_t value) {
+  return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+inline int64_t zigzag_decode(uint64_t value) {
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// LEB128 varint, 7 bits per byte, MSB = continuation. Returns bytes written (max 10).
+static constexpr uint8_t VARINT_MAX_SIZE = 10;
+
+inline uint8_t varint_encode(uint64_t value, uint8_t *out) {
+  uint8_t n = 0;
+  while (value >= 0x80) {
+    out[n++] = static_cast<uint8_t>(value) | 0x80;
+    value >>= 7;
+  }
+  out[n++] = static_cast<uint8_t>(value);
+  return n;
+}
+
+// Reads one varint from [pos, end) and advances pos. False if it is truncated or too long.
+inline bool varint_decode(const uint8_t *&pos, const uint8_t *end, uint64_t &value) {
+  value = 0;
+  for (uint8_t n = 0; n < VARINT_MAX_SIZE && pos < end; n++) {
+    uint8_t byte = *pos++;
+    value |= static_cast<uint64_t>(byte & 0x7F) << (7 * n);
+    if ((byte & 0x80) == 0)
+      return true;
+  }
+  return false;
+}
+
+// Fixed-memory ring of (time, value) samples.
+//
+// The oldest sample is kept as an absolute anchor; every later sample is stored as
+// varint(dt) + varint(zigzag(dvalue)) in a circular byte buffer. When a new record
+// does not fit, the oldest records are folded into the anchor until it does.
+class TimeSeriesRing {
+ public:
+  static constexpr size_t MIN_CAPACITY = 2 * VARINT_MAX_SIZE;
+
+  void init(size_t capacity) {
+    this->buffer_.assign(capacity < MIN_CAPACITY ? MIN_CAPACITY : capacity, 0);
+    this->clear();
+  }
+
+  void clear() {
+    this->head_ = 0;
+    this->used_ = 0;
+    this->count_ = 0;
+  }
+
+  void append(uint32_t time, int64_t value) {
+    if (this->count_ == 0) {
+      this->anchor_time_ = this->last_time_ = time;
+      this->anchor_value_ = this->last_value_ = value;
+      this->count_ = 1;
+      return;
+    }
+
+    uint8_t record[2 * VARINT_MAX_SIZE];
+    uint8_t len = varint_encode(time - this->last_time_, record);
+    len += varint_encode(zigzag_encode(value - this->last_value_), record + len);
+
+    while (this->used_ + len > this->buffer_.size())
+      this->drop_oldest_();
+
+    size_t pos = (this->head_ + this->used_) % this->buffer_.size();
+    for (uint8_t i = 0; i < len; i++) {
+      this->buffer_[pos] = record[i];
+      pos = pos + 1 == this->buffer_.size() ? 0 : pos + 1;
+    }
+    this->used_ += len;
+    this->count_++;
+    this->last_time_ = time;
+    this->last_value_ = value;
+  }
+
+  // Calls callback(time, value) for every stored sample, oldest first
+  template<typename F> void for_each(F &&callback) const {
+    if (this->count_ == 0)
+      return;
+    uint32_t time = this->anchor_time_;
+    int64_t value = this->anchor_value_;
+    callback(time, value);
+
+    size_t pos = this->head_;
+    size_t remaining = this->used_;
+    while (remaining > 0) {
+      uint64_t dt, dv;
+      uint8_t len = this->read_varint_(pos, dt);
+      len += this->read_varint_((pos + len) % this->buffer_.size(), dv);
+      pos = (pos + len) % this->buffer_.size();
+      remaining -= len;
+      time += static_cast<uint32_t>(dt);
+      value += zigzag_decode(dv);
+      callback(time, value);
+    }
+  }
+
+  size_t size() const { return this->count_; }
+  // Times of the oldest and the newest sample, valid if size() > 0
+  uint32_t first_time() const { return this->anchor_time_; }
+  uint32_t last_time() const { return this->last_time_; }
+  size_t capacity() const { return this->buffer_.size(); }
+  size_t bytes_used() const { return this->used_; }
+
+ protected:
+  uint8_t read_varint_(size_t pos, uint64_t &value) const {
+    value = 0;
+    uint8_t n = 0;
+    uint8_t byte;
+    do {
+      byte = this->buffer_[pos];
+      value |= static_cast<uint64_t>(byte & 0x7F) << (7 * n);
+      n++;
+      pos = pos + 1 == this->buffer_.size() ? 0 : pos + 1;
+    } while ((byte & 0x80) != 0 && n < VARINT_MAX_SIZE);
+    return n;
+  }
+
+  // Fold the oldest delta record into the anchor
+  void drop_oldest_() {
+    uint64_t dt, dv;
+    uint8_t len = this->read_varint_(this->head_, dt);
+    len += this->read_varint_((this->head_ + len) % this->buffer_.size(), dv);
+    this->anchor_time_ += static_cast<uint32_t>(dt);
+    this->anchor_value_ += zigzag_decode(dv);
+    this->head_ = (this->head_ + len) % this->buffer_.size();
+    this->used_ -= len;
+    this->count_--;
+  }
+
+  std::vector<uint8_t> buffer_;
+  size_t head_ = 0;
+  size_t used_ = 0;
+  size_t count_ = 0;
+  uint32_t anchor_time_ = 0;
+  int64_t anchor_value_ = 0;
+  uint32_t last_time_ = 0;
+  int64_t last_value_ = 0;
+};
+
+// The samples with from <= time <= to in the binary history format: the first sample
+// absolute, then varint(dt) + varint(zigzag(dvalue)) per sample
+inline std::vector<uint8_t> encode_series(const TimeSeriesRing &ring, uint32_t from, uint32_t to) {
+  std::vector<uint8_t> out;
+  out.reserve(ring.bytes_used() + 2 * VARINT_MAX_SIZE);
+  bool first = true;
+  uint32_t prev_time = 0;
+  int64_t prev_value = 0;
+  ring.for_each([&](uint32_t time, int64_t value) {
+    if (time < from || time > to)
+      return;
+    uint8_t buf[2 * VARINT_MAX_SIZE];
+    uint8_t len = varint_encode(first ? time : time - prev_time, buf);
+    len += varint_encode(zigzag_encode(first ? value : value - prev_value), buf + len);
+    out.insert(out.end(), buf, buf + len);
+    first = false;
+    prev_time = time;
+    prev_value = value;
+  });
+  return out;
+}
+
+}  // namespace esphome::gplugk
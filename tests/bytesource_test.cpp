@@ -0,0 +1,241 @@
+// Host test for the byte source interface with a simulated meter on a 2400 baud line.
+//
+//   g++ -std=gnu++17 -I components/gplugk tests/bytesource_test.cpp -o bytesource_test && ./bytesource_test
+//
+// Run from the repository root, it reads the frames in messages/raw.txt.
+
+#include "bytesource_base.h"
+#include "hdlc.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace esphome::gplugk;
+
+namespace {
+
+constexpr const char *FRAMES_PATH = "messages/raw.txt";
+constexpr uint32_t READ_TIMEOUT_MS = 1000;
+constexpr uint32_t CHUNK_INTERVAL_MS = 100;  // 2400 baud is 24 bytes in 100 ms
+constexpr size_t CHUNK_SIZE = 24;
+constexpr uint32_t FRAME_INTERVAL_MS = 10000;
+
+int failures = 0;
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      failures++; \
+    } \
+  } while (0)
+
+// Bytes arrive as the test delivers them; quiet() follows a simulated clock
+class SimulatedSource : public ByteSource {
+ public:
+  void deliver(const uint8_t *data, size_t length) {
+    this->rx_.insert(this->rx_.end(), data, data + length);
+    this->last_arrival_ = this->now;
+  }
+
+  size_t available() override { return this->rx_.size() - this->pos_; }
+  bool read(uint8_t *data, size_t length) override {
+    if (length > this->available())
+      return false;
+    memcpy(data, &this->rx_[this->pos_], length);
+    this->pos_ += length;
+    return true;
+  }
+  bool quiet() override { return this->now - this->last_arrival_ > READ_TIMEOUT_MS; }
+
+  uint32_t now = 0;
+
+ protected:
+  std::vector<uint8_t> rx_;
+  size_t pos_ = 0;
+  uint32_t last_arrival_ = 0;
+};
+
+// Frame assembly as in GplugkComponent::receive_(): a frame ends when its HDLC length is
+// complete, or otherwise when the line goes quiet
+class Receiver {
+ public:
+  struct Frame {
+    std::vector<uint8_t> data;
+    uint32_t time;  // when it was handed on
+    bool complete;  // by its HDLC length rather than the timeout
+  };
+
+  explicit Receiver(ByteSource &source) : source_(source) {}
+
+  void poll(uint32_t now) {
+    if (this->source_.available() > 0)
+      read_available(this->source_, this->buffer_, HDLC_MAX_FRAME_SIZE - this->buffer_.size());
+    if (this->buffer_.empty())
+      return;
+    bool complete = this->buffer_.size() >= HDLC_INFO_OFFSET && hdlc_frame_size(this->buffer_.data()) != 0 &&
+                    this->buffer_.size() >= hdlc_frame_size(this->buffer_.data());
+    if (complete || this->source_.quiet()) {
+      this->frames.push_back({this->buffer_, now, complete});
+      this->buffer_.clear();
+    }
+  }
+
+  std::vector<Frame> frames;
+
+ protected:
+  ByteSource &source_;
+  std::vector<uint8_t> buffer_;
+};
+
+// The hex lines of the file; other lines, e.g. the key, are skipped
+std::vector<std::vector<uint8_t>> load_frames() {
+  std::vector<std::vector<uint8_t>> frames;
+  std::ifstream file(FRAMES_PATH);
+  std::string line;
+  while (std::getline(file, line)) {
+    std::istringstream tokens(line);
+    std::vector<uint8_t> frame;
+    std::string token;
+    bool hex = true;
+    while (tokens >> token && hex) {
+      hex = token.size() == 2 && isxdigit(token[0]) && isxdigit(token[1]);
+      frame.push_back(strtoul(token.c_str(), nullptr, 16));
+    }
+    if (hex && !frame.empty())
+      frames.push_back(frame);
+  }
+  return frames;
+}
+
+// Delivers each frame in line-speed chunks and polls every 10 ms
+std::vector<Receiver::Frame> replay(const std::vector<std::vector<uint8_t>> &frames, uint32_t &last_byte_time) {
+  SimulatedSource source;
+  Receiver receiver(source);
+  uint32_t start = 1000;
+  for (const auto &frame : frames) {
+    for (size_t offset = 0; offset < frame.size(); offset += CHUNK_SIZE) {
+      uint32_t due = start + offset / CHUNK_SIZE * CHUNK_INTERVAL_MS;
+      for (; source.now < due; source.now += 10)
+        receiver.poll(source.now);
+      source.deliver(&frame[offset], std::min(CHUNK_SIZE, frame.size() - offset));
+      last_byte_time = source.now;
+    }
+    start += FRAME_INTERVAL_MS;
+  }
+  for (; source.now < start + READ_TIMEOUT_MS; source.now += 10)
+    receiver.poll(source.now);
+  return receiver.frames;
+}
+
+void test_contract() {
+  SimulatedSource source;
+  uint8_t data[100];
+  for (size_t i = 0; i < sizeof(data); i++)
+    data[i] = i;
+  CHECK(source.available() == 0);
+  uint8_t byte;
+  CHECK(!source.read(&byte, 1));
+
+  source.now = 50;
+  source.deliver(data, sizeof(data));
+  CHECK(source.available() == sizeof(data));
+  uint8_t out[100];
+  CHECK(source.read(out, 30));
+  CHECK(source.available() == 70);
+  // A read of more than is available takes nothing
+  CHECK(!source.read(out, 71));
+  CHECK(source.available() == 70);
+
+  std::vector<uint8_t> buffer;
+  CHECK(read_available(source, buffer, 40) == 40);
+  CHECK(source.available() == 30);
+  CHECK(read_available(source, buffer, 1000) == 30);
+  CHECK(source.available() == 0);
+  CHECK(read_available(source, buffer, 1000) == 0);
+  CHECK(buffer.size() == 70 && memcmp(buffer.data(), data + 30, 70) == 0);
+
+  // Quiet only once the timeout has passed since the last byte
+  source.now = 50 + READ_TIMEOUT_MS;
+  CHECK(!source.quiet());
+  source.now++;
+  CHECK(source.quiet());
+  source.deliver(data, 1);
+  CHECK(!source.quiet());
+}
+
+void test_frames() {
+  std::vector<std::vector<uint8_t>> frames = load_frames();
+  CHECK(frames.size() == 2);
+  for (const auto &frame : frames)
+    CHECK(hdlc_frame_size(frame.data()) == frame.size());
+
+  uint32_t last_byte_time;
+  std::vector<Receiver::Frame> received = replay(frames, last_byte_time);
+  CHECK(received.size() == frames.size());
+  for (size_t i = 0; i < received.size() && i < frames.size(); i++) {
+    CHECK(received[i].data == frames[i]);
+    // Handed on with the poll after its last byte, not after the read timeout
+    CHECK(received[i].complete);
+    uint32_t last_chunk = 1000 + i * FRAME_INTERVAL_MS + (frames[i].size() - 1) / CHUNK_SIZE * CHUNK_INTERVAL_MS;
+    CHECK(received[i].time == last_chunk);
+  }
+}
+
+// A frame cut short is only handed on once the line is quiet
+void test_truncated_frame() {
+  std::vector<std::vector<uint8_t>> frames = load_frames();
+  if (frames.empty())
+    return;
+  frames.resize(1);
+  frames[0].resize(frames[0].size() - 5);
+  uint32_t last_byte_time;
+  std::vector<Receiver::Frame> received = replay(frames, last_byte_time);
+  CHECK(received.size() == 1);
+  if (received.size() == 1) {
+    CHECK(!received[0].complete);
+    CHECK(received[0].data == frames[0]);
+    CHECK(received[0].time > last_byte_time + READ_TIMEOUT_MS);
+    CHECK(received[0].time <= last_byte_time + READ_TIMEOUT_MS + 10);
+  }
+}
+
+// Without a valid header, bytes are collected up to one frame size and then split
+void test_noise() {
+  SimulatedSource source;
+  Receiver receiver(source);
+  std::vector<uint8_t> noise(HDLC_MAX_FRAME_SIZE + 100, 0x55);
+  source.deliver(noise.data(), noise.size());
+  receiver.poll(0);
+  CHECK(receiver.frames.empty());
+  CHECK(source.available() == 100);
+  source.now = READ_TIMEOUT_MS + 1;
+  receiver.poll(source.now);
+  receiver.poll(source.now);
+  CHECK(receiver.frames.size() == 2);
+  if (receiver.frames.size() == 2) {
+    CHECK(receiver.frames[0].data.size() == HDLC_MAX_FRAME_SIZE);
+    CHECK(receiver.frames[1].data.size() == 100);
+  }
+}
+
+}  // namespace
+
+int main() {
+  test_contract();
+  test_frames();
+  test_truncated_frame();
+  test_noise();
+  if (failures != 0) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All byte source tests passed\n");
+  return 0;
+}
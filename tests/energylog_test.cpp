@@ -0,0 +1,284 @@
+// Host test for the energy log on a file that behaves like NOR flash.
+//
+//   g++ -std=gnu++17 -I components/gplugk tests/energylog_test.cpp -o energylog_test && ./energylog_test
+
+#include "energylog.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <vector>
+
+using namespace esphome::gplugk;
+
+namespace {
+
+constexpr const char *PATH = "energylog_test.bin";
+constexpr size_t SIZE = 16 * LogStorage::SECTOR_SIZE;
+constexpr uint8_t CHANNELS = 8;
+constexpr uint32_t LAYOUT = 0x1234;
+constexpr uint32_t INTERVAL = 3600;
+
+struct Record {
+  uint32_t time;
+  std::vector<int64_t> values;
+  bool operator==(const Record &other) const { return time == other.time && values == other.values; }
+};
+
+int failures = 0;
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      failures++; \
+    } \
+  } while (0)
+
+// Counters that grow by a few hundred per interval, like a household meter
+class Meter {
+ public:
+  Record next() {
+    this->time_ += INTERVAL + rand() % 21 - 10;
+    for (uint8_t i = 0; i < CHANNELS; i++)
+      this->values_[i] += rand() % 1500;
+    return {this->time_, std::vector<int64_t>(this->values_, this->values_ + CHANNELS)};
+  }
+
+ protected:
+  uint32_t time_ = 1753307900;
+  int64_t values_[CHANNELS] = {47762400, 34995500, 15000000, 16000000, 16762400, 11000000, 12000000, 11995500};
+};
+
+std::vector<Record> read_all(const EnergyLog &log) {
+  std::vector<Record> records;
+  log.for_each([&](uint32_t time, const int64_t *values) {
+    records.push_back({time, std::vector<int64_t>(values, values + CHANNELS)});
+    return true;
+  });
+  return records;
+}
+
+// Counts the sectors that are read in full
+class CountingStorage : public FileStorage {
+ public:
+  bool read(size_t offset, uint8_t *data, size_t length) override {
+    if (length == SECTOR_SIZE)
+      this->sector_reads++;
+    return FileStorage::read(offset, data, length);
+  }
+
+  size_t sector_reads = 0;
+};
+
+// The stored records must be the newest ones that were appended, in order
+bool is_suffix(const std::vector<Record> &stored, const std::vector<Record> &appended) {
+  if (stored.size() > appended.size())
+    return false;
+  return std::equal(stored.begin(), stored.end(), appended.end() - stored.size());
+}
+
+void test_reopen() {
+  unlink(PATH);
+  Meter meter;
+  std::vector<Record> appended;
+  {
+    FileStorage storage;
+    EnergyLog log;
+    CHECK(storage.open(PATH, SIZE));
+    CHECK(log.open(&storage, CHANNELS, LAYOUT, INTERVAL));
+    CHECK(log.empty());
+    for (int i = 0; i < 100; i++) {
+      appended.push_back(meter.next());
+      log.append(appended.back().time, appended.back().values.data());
+    }
+    CHECK(read_all(log) == appended);
+    CHECK(log.flush(true));
+  }
+  FileStorage storage;
+  EnergyLog log;
+  CHECK(storage.open(PATH, SIZE));
+  CHECK(log.open(&storage, CHANNELS, LAYOUT, INTERVAL));
+  CHECK(!log.empty());
+  CHECK(log.last_time() == appended.back().time);
+  CHECK(read_all(log) == appended);
+}
+
+void test_wrap() {
+  unlink(PATH);
+  Meter meter;
+  std::vector<Record> appended;
+  {
+    FileStorage storage;
+    EnergyLog log;
+    CHECK(storage.open(PATH, SIZE));
+    CHECK(log.open(&storage, CHANNELS, LAYOUT, INTERVAL));
+    for (int i = 0; i < 5000; i++) {
+      appended.push_back(meter.next());
+      log.append(appended.back().time, appended.back().values.data());
+      // Half the time the next sector is erased ahead, otherwise when append() wraps
+      if (i % 2 == 0 && log.needs_erase())
+        CHECK(log.erase_next());
+    }
+    std::vector<Record> stored = read_all(log);
+    CHECK(stored.size() < appended.size());
+    CHECK(is_suffix(stored, appended));
+    CHECK(log.flush(true));
+  }
+  FileStorage storage;
+  EnergyLog log;
+  CHECK(storage.open(PATH, SIZE));
+  CHECK(log.open(&storage, CHANNELS, LAYOUT, INTERVAL));
+  CHECK(is_suffix(read_all(log), appended));
+  CHECK(log.last_time() == appended.back().time);
+}
+
+// Power lost after a page-aligned flush that wrote only the start of a record
+void test_power_loss_mid_record() {
+  unlink(PATH);
+  Meter meter;
+  std::vector<Record> appended;
+  {
+    FileStorage storage;
+    EnergyLog log;
+    CHECK(storage.open(PATH, SIZE));
+    CHECK(log.open(&storage, CHANNELS, LAYOUT, INTERVAL));
+    for (int i = 0; i < 20; i++) {
+      appended.push_back(meter.next());
+      log.append(appended.back().time, appended.back().values.data());
+    }
+    // No final flush: the records after the last complete page are lost
+  }
+  size_t recovered;
+  {
+    FileStorage storage;
+    EnergyLog log;
+    CHECK(storage.open(PATH, SIZE));
+    CHECK(log.open(&storage, CHANNELS, LAYOUT, INTERVAL));
+    std::vector<Record> stored = read_all(log);
+    recovered = stored.size();
+    CHECK(recovered > 0 && recovered < appended.size());
+    CHECK(std::equal(stored.begin(), stored.end(), appended.begin()));
+    appended.resize(recovered);
+    for (int i = 0; i < 3; i++) {
+      appended.push_back(meter.next());
+      log.append(appended.back().time, appended.back().values.data());
+    }
+    CHECK(log.flush(true));
+  }
+  FileStorage storage;
+  EnergyLog log;
+  CHECK(storage.open(PATH, SIZE));
+  CHECK(log.open(&storage, CHANNELS, LAYOUT, INTERVAL));
+  CHECK(read_all(log) == appended);
+  CHECK(log.last_time() == appended.back().time);
+}
+
+// from skips the sectors that end before it, and the callback can stop the scan
+void test_from_and_stop() {
+  unlink(PATH);
+  Meter meter;
+  std::vector<Record> appended;
+  CountingStorage storage;
+  EnergyLog log;
+  CHECK(storage.open(PATH, SIZE));
+  CHECK(log.open(&storage, CHANNELS, LAYOUT, INTERVAL));
+  for (int i = 0; i < 5000; i++) {
+    appended.push_back(meter.next());
+    log.append(appended.back().time, appended.back().values.data());
+  }
+  storage.sector_reads = 0;
+  std::vector<Record> stored = read_all(log);
+  CHECK(storage.sector_reads == log.sectors());
+
+  uint32_t from = stored[stored.size() - 10].time;
+  std::vector<Record> records;
+  storage.sector_reads = 0;
+  log.for_each(
+      [&](uint32_t time, const int64_t *values) {
+        if (time >= from)
+          records.push_back({time, std::vector<int64_t>(values, values + CHANNELS)});
+        return true;
+      },
+      from);
+  CHECK(std::equal(records.begin(), records.end(), stored.end() - 10, stored.end()) && records.size() == 10);
+  CHECK(storage.sector_reads <= 2);
+
+  size_t count = 0;
+  storage.sector_reads = 0;
+  log.for_each([&](uint32_t, const int64_t *) { return ++count < 5; });
+  CHECK(count == 5);
+  CHECK(storage.sector_reads == 1);
+}
+
+// A view taken before the log wrapped around leaves the reused sectors alone
+void test_stale_view() {
+  unlink(PATH);
+  Meter meter;
+  std::vector<Record> appended;
+  FileStorage storage;
+  EnergyLog log;
+  CHECK(storage.open(PATH, SIZE));
+  CHECK(log.open(&storage, CHANNELS, LAYOUT, INTERVAL));
+  for (int i = 0; i < 3500; i++) {
+    appended.push_back(meter.next());
+    log.append(appended.back().time, appended.back().values.data());
+  }
+  EnergyLog::View view = log.view();
+  // Enough to wrap around to the sector that was the head
+  for (int i = 0; i < 4000; i++) {
+    appended.push_back(meter.next());
+    log.append(appended.back().time, appended.back().values.data());
+  }
+  // Everything is in flash now, so the stale view must not change what is read
+  CHECK(log.flush(true));
+  std::vector<Record> records;
+  log.for_each(view, [&](uint32_t time, const int64_t *values) {
+    records.push_back({time, std::vector<int64_t>(values, values + CHANNELS)});
+    return true;
+  });
+  CHECK(records == read_all(log));
+  CHECK(is_suffix(records, appended));
+}
+
+void test_other_layout() {
+  unlink(PATH);
+  Meter meter;
+  {
+    FileStorage storage;
+    EnergyLog log;
+    CHECK(storage.open(PATH, SIZE));
+    CHECK(log.open(&storage, CHANNELS, LAYOUT, INTERVAL));
+    for (int i = 0; i < 50; i++) {
+      Record record = meter.next();
+      log.append(record.time, record.values.data());
+    }
+    CHECK(log.flush(true));
+  }
+  FileStorage storage;
+  EnergyLog log;
+  CHECK(storage.open(PATH, SIZE));
+  CHECK(log.open(&storage, 2, LAYOUT + 1, INTERVAL));
+  CHECK(log.empty());
+  CHECK(read_all(log).empty());
+}
+
+}  // namespace
+
+int main() {
+  srand(1);
+  test_reopen();
+  test_wrap();
+  test_power_loss_mid_record();
+  test_from_and_stop();
+  test_stale_view();
+  test_other_layout();
+  unlink(PATH);
+  if (failures != 0) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All energy log tests passed\n");
+  return 0;
+}
@@ -0,0 +1,268 @@
+// Host test for the varint helpers and the history ring.
+//
+//   g++ -std=gnu++17 -I components/gplugk tests/timeseries_test.cpp -o timeseries_test && ./timeseries_test
+
+#include "timeseries.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <limits>
+#include <vector>
+
+using namespace esphome::gplugk;
+
+namespace {
+
+struct Sample {
+  uint32_t time;
+  int64_t value;
+  bool operator==(const Sample &other) const { return time == other.time && value == other.value; }
+};
+
+int failures = 0;
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      failures++; \
+    } \
+  } while (0)
+
+// What the ring should hold: the newest samples whose delta records fit in the buffer
+class Reference {
+ public:
+  explicit Reference(size_t capacity) : capacity_(capacity) {}
+
+  void append(uint32_t time, int64_t value) {
+    if (this->samples_.empty()) {
+      this->samples_.push_back({time, value});
+      this->sizes_.push_back(0);
+      return;
+    }
+    size_t size = record_size_(this->samples_.back(), {time, value});
+    while (this->used_ + size > this->capacity_) {
+      // The second sample becomes the anchor, its record is no longer stored
+      this->samples_.pop_front();
+      this->sizes_.pop_front();
+      this->used_ -= this->sizes_.front();
+      this->sizes_.front() = 0;
+    }
+    this->samples_.push_back({time, value});
+    this->sizes_.push_back(size);
+    this->used_ += size;
+  }
+
+  std::vector<Sample> samples() const { return {this->samples_.begin(), this->samples_.end()}; }
+  size_t used() const { return this->used_; }
+
+ protected:
+  static size_t record_size_(const Sample &prev, const Sample &next) {
+    uint8_t buf[2 * VARINT_MAX_SIZE];
+    return varint_encode(next.time - prev.time, buf) + varint_encode(zigzag_encode(next.value - prev.value), buf);
+  }
+
+  size_t capacity_;
+  std::deque<Sample> samples_;
+  std::deque<size_t> sizes_;
+  size_t used_ = 0;
+};
+
+std::vector<Sample> read_all(const TimeSeriesRing &ring) {
+  std::vector<Sample> samples;
+  ring.for_each([&](uint32_t time, int64_t value) { samples.push_back({time, value}); });
+  return samples;
+}
+
+bool matches(const TimeSeriesRing &ring, const Reference &reference) {
+  std::vector<Sample> expected = reference.samples();
+  return read_all(ring) == expected && ring.size() == expected.size() && ring.bytes_used() == reference.used() &&
+         ring.first_time() == expected.front().time && ring.last_time() == expected.back().time;
+}
+
+void check_round_trip(int64_t value) {
+  CHECK(zigzag_decode(zigzag_encode(value)) == value);
+  uint8_t buf[VARINT_MAX_SIZE];
+  uint8_t length = varint_encode(zigzag_encode(value), buf);
+  CHECK(length >= 1 && length <= VARINT_MAX_SIZE);
+  const uint8_t *pos = buf;
+  uint64_t decoded;
+  CHECK(varint_decode(pos, buf + length, decoded));
+  CHECK(pos == buf + length);
+  CHECK(zigzag_decode(decoded) == value);
+  // A truncated varint is rejected
+  pos = buf;
+  CHECK(length == 1 || !varint_decode(pos, buf + length - 1, decoded));
+}
+
+void test_varint_round_trip() {
+  // Ascending and descending through every bit width, around each power of two
+  for (int bit = 0; bit < 63; bit++) {
+    int64_t power = int64_t{1} << bit;
+    for (int64_t value : {power - 1, power, power + 1}) {
+      check_round_trip(value);
+      check_round_trip(-value);
+    }
+  }
+  for (int64_t value = -300; value <= 300; value++)
+    check_round_trip(value);
+  check_round_trip(std::numeric_limits<int64_t>::min());
+  check_round_trip(std::numeric_limits<int64_t>::max());
+
+  // Small magnitudes stay small whatever their sign
+  CHECK(zigzag_encode(0) == 0);
+  CHECK(zigzag_encode(-1) == 1);
+  CHECK(zigzag_encode(1) == 2);
+  CHECK(zigzag_encode(-64) == 127);
+  uint8_t buf[VARINT_MAX_SIZE];
+  CHECK(varint_encode(zigzag_encode(-64), buf) == 1);
+  CHECK(varint_encode(zigzag_encode(64), buf) == 2);
+  CHECK(varint_encode(std::numeric_limits<uint64_t>::max(), buf) == VARINT_MAX_SIZE);
+}
+
+// A buffer of MIN_CAPACITY holds a single record of the largest size
+void test_wrap_at_min_capacity() {
+  TimeSeriesRing ring;
+  ring.init(1);
+  CHECK(ring.capacity() == TimeSeriesRing::MIN_CAPACITY);
+  Reference reference(ring.capacity());
+  uint32_t time = 0;
+  int64_t value = 0;
+  for (int i = 0; i < 1000; i++) {
+    // Alternate between tiny and maximal deltas, so records straddle the end of the buffer
+    time += i % 3 == 0 ? 1 : 0xFFFFFFF0u;
+    value += i % 2 == 0 ? std::numeric_limits<int64_t>::max() / 2 : i % 100 - std::numeric_limits<int64_t>::max() / 2;
+    ring.append(time, value);
+    reference.append(time, value);
+    CHECK(matches(ring, reference));
+    CHECK(ring.bytes_used() <= ring.capacity());
+  }
+}
+
+// Randomised against the reference, including first_time()/last_time()/size() after eviction
+void test_eviction() {
+  for (size_t capacity : {20, 21, 64, 3276}) {
+    TimeSeriesRing ring;
+    ring.init(capacity);
+    Reference reference(capacity);
+    uint32_t time = 1753307900;
+    int64_t value = 416;
+    size_t evictions = 0;
+    for (int i = 0; i < 20000; i++) {
+      time += 10 + rand() % 3;
+      switch (rand() % 4) {
+        case 0:
+          value += rand() % 50 - 25;
+          break;
+        case 1:
+          value += static_cast<int64_t>(rand()) * (rand() % 2 == 0 ? 1 : -1);
+          break;
+        case 2:
+          value = 0;
+          break;
+        default:
+          break;
+      }
+      size_t before = ring.size();
+      ring.append(time, value);
+      reference.append(time, value);
+      evictions += ring.size() <= before;
+      if (!matches(ring, reference)) {
+        printf("capacity %zu: mismatch after %d samples\n", capacity, i + 1);
+        failures++;
+        break;
+      }
+    }
+    CHECK(evictions > 0);
+    CHECK(ring.last_time() == time);
+  }
+}
+
+void test_clear() {
+  TimeSeriesRing ring;
+  ring.init(64);
+  ring.append(100, 5);
+  ring.append(110, 7);
+  ring.clear();
+  CHECK(ring.size() == 0);
+  CHECK(ring.bytes_used() == 0);
+  CHECK(read_all(ring).empty());
+  ring.append(200, -3);
+  CHECK(ring.size() == 1);
+  CHECK(ring.first_time() == 200 && ring.last_time() == 200);
+  CHECK((read_all(ring) == std::vector<Sample>{{200, -3}}));
+}
+
+// Decoder for the binary response of /gplugk/history
+std::vector<Sample> decode_series(const std::vector<uint8_t> &data) {
+  std::vector<Sample> samples;
+  const uint8_t *pos = data.data();
+  const uint8_t *end = pos + data.size();
+  uint32_t time = 0;
+  int64_t value = 0;
+  while (pos < end) {
+    uint64_t dt, dv;
+    if (!varint_decode(pos, end, dt) || !varint_decode(pos, end, dv)) {
+      failures++;
+      printf("truncated series\n");
+      break;
+    }
+    time += static_cast<uint32_t>(dt);
+    value += zigzag_decode(dv);
+    samples.push_back({time, value});
+  }
+  return samples;
+}
+
+void test_binary_encoding() {
+  TimeSeriesRing ring;
+  ring.init(256);
+  CHECK(encode_series(ring, 0, UINT32_MAX).empty());
+
+  Reference reference(256);
+  uint32_t time = 1000;
+  int64_t value = 0;
+  for (int i = 0; i < 200; i++) {
+    time += 10;
+    value += rand() % 2001 - 1000;
+    ring.append(time, value);
+    reference.append(time, value);
+  }
+  std::vector<Sample> stored = reference.samples();
+  CHECK(decode_series(encode_series(ring, 0, UINT32_MAX)) == stored);
+
+  // The first sample in the range is absolute, whether or not it is the anchor
+  uint32_t from = stored[3].time;
+  uint32_t to = stored[stored.size() - 2].time;
+  std::vector<Sample> expected(stored.begin() + 3, stored.end() - 1);
+  CHECK(decode_series(encode_series(ring, from, to)) == expected);
+  CHECK(decode_series(encode_series(ring, from, from)) == std::vector<Sample>{stored[3]});
+  CHECK(encode_series(ring, time + 1, UINT32_MAX).empty());
+
+  // Byte by byte for a short series
+  TimeSeriesRing small;
+  small.init(64);
+  small.append(300, 1);
+  small.append(310, -1);
+  small.append(450, 63);
+  std::vector<uint8_t> expected_bytes = {0xAC, 0x02, 0x02, 0x0A, 0x03, 0x8C, 0x01, 0x80, 0x01};
+  CHECK(encode_series(small, 0, UINT32_MAX) == expected_bytes);
+}
+
+}  // namespace
+
+int main() {
+  srand(1);
+  test_varint_round_trip();
+  test_wrap_at_min_capacity();
+  test_eviction();
+  test_clear();
+  test_binary_encoding();
+  if (failures != 0) {
+    printf("%d checks failed\n", failures);
+    return 1;
+  }
+  printf("All time series tests passed\n");
+  return 0;
+}